@@ -6,12 +6,47 @@
 #include "common/Util.h"
 #include "common/VmConstant.h"
 #include <fstream>
+#include <unistd.h>
 
-JNIEnv *VM_CONTEXT::env = nullptr;
+thread_local JNIEnv *VM_CONTEXT::env = nullptr;
+JavaVM *VM_CONTEXT::javaVm = nullptr;
 VmDataFile *VM_CONTEXT::vmDataFile = nullptr;
 VmKeyFuncCodeFile *VM_CONTEXT::vmKFCFile = nullptr;
 Vm *VM_CONTEXT::vm = nullptr;
 
+// detaches the threads attached by attachCurrentThread on their exit.
+struct VmThreadDetacher {
+    bool attached = false;
+
+    ~VmThreadDetacher() {
+        if (this->attached) {
+            (*VM_CONTEXT::javaVm).DetachCurrentThread();
+        }
+    }
+};
+
+static thread_local VmThreadDetacher threadDetacher;
+
+JNIEnv *VM_CONTEXT::attachCurrentThread() {
+    if (VM_CONTEXT::env != nullptr) {
+        return VM_CONTEXT::env;
+    }
+    assert(VM_CONTEXT::javaVm != nullptr);
+    JNIEnv *pEnv = nullptr;
+    jint ret = (*VM_CONTEXT::javaVm).GetEnv((void **) &pEnv, JNI_VERSION_1_4);
+    if (ret == JNI_EDETACHED) {
+        if ((*VM_CONTEXT::javaVm).AttachCurrentThread(&pEnv, nullptr) != JNI_OK) {
+            throw VMException("attach current thread to java vm failed.");
+        }
+        threadDetacher.attached = true;
+        LOG_I("attach current thread to java vm, tid: %d", gettid());
+    } else if (ret != JNI_OK) {
+        throw VMException("get env of current thread failed.");
+    }
+    VM_CONTEXT::env = pEnv;
+    return pEnv;
+}
+
 void VM_CONTEXT::initVmDataFileOfVC() {
     LOG_I("start,  initVmDataFileOfVC");
     uint32_t bufSize = 0;
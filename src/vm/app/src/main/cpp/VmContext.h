@@ -12,13 +12,21 @@
 
 class VM_CONTEXT {
 public:
-    static JNIEnv *env;
+    // JNIEnv of the calling thread, set by attachCurrentThread.
+    static thread_local JNIEnv *env;
+    static JavaVM *javaVm;
     static VmDataFile *vmDataFile;
     static VmKeyFuncCodeFile* vmKFCFile;
     static Vm *vm;
 
 public:
 
+    /**
+     * makes VM_CONTEXT::env valid on the calling thread, attaching a native
+     * thread to the java vm the first time. it is detached when it exits.
+     */
+    static JNIEnv *attachCurrentThread();
+
     static void initVmDataFileOfVC();
 
     static void initVmKeyFuncCodeFileOfVC();
@@ -12,6 +12,25 @@ struct VM_CONFIG {
     RD_STR DEST_APP_DEX_FILE_NAME = "classes.dex";
     RD_STR DEST_APP_APPLICATION_NAME = "application_name";
     RD_STR VM_KEY_FUNC_CODE_FILE_NAME = "code";
+    // "linear" or "random", overrides VM_STACK_LINEAR for one app.
+    RD_STR VM_STACK_POLICY = "vm_stack";
+    // overrides VM_STACK_MAX_DEPTH for one app.
+    RD_STR VM_STACK_DEPTH = "vm_stack_depth";
+    // KB faulted in at the start of VmRandomMemory, overrides VM_MEMORY_PREFAULT_SIZE.
+    RD_STR VM_MEMORY_PREFAULT = "vm_memory_prefault";
+    // "true" or "false", overrides VM_MEMORY_USE_HUGE_PAGE.
+    RD_STR VM_MEMORY_HUGE_PAGE = "vm_memory_huge_page";
+    // KB opened at a time in VmRandomMemory, overrides VM_MEMORY_GROW_SIZE.
+    RD_STR VM_MEMORY_GROW = "vm_memory_grow";
+    // a fixed seed of VmRandom, for reproducible runs.
+    RD_STR VM_RANDOM_SEED = "vm_random_seed";
+    // threads of Vm::callMethodAsync, overrides VM_WORKER_THREAD_COUNT.
+    RD_STR VM_WORKER_THREADS = "vm_worker_threads";
+    // the default VmCallBudget of every thread, 0 or missing for no limit.
+    RD_STR VM_CALL_BUDGET_BACK_EDGES = "vm_call_budget_back_edges";
+    RD_STR VM_CALL_BUDGET_MS = "vm_call_budget_ms";
+    // "true" throws once over the budget, "false" only logs.
+    RD_STR VM_CALL_BUDGET_THROW = "vm_call_budget_throw";
 
     // runtime path
     RD_STR RUNTIME_LIB_PATH = "/lib";
@@ -21,10 +40,48 @@ struct VM_CONFIG {
 
     // vm
     static const uint64_t VM_MEMORY_SIZE = 64UL << 20U;
-    static const uint32_t VM_MEMORY_FREE_PAGE_SIZE = 8u;
+    // free pages kept resident by VmRandomMemory, trimmed down to LOW once above HIGH.
+    static const uint32_t VM_MEMORY_FREE_PAGE_HIGH = 64u;
+    static const uint32_t VM_MEMORY_FREE_PAGE_LOW = 16u;
+    static const uint64_t VM_MEMORY_PREFAULT_SIZE = 0u;
+    static const bool VM_MEMORY_USE_HUGE_PAGE = false;
+    // 0 opens the whole VM_MEMORY_SIZE up front.
+    static const uint64_t VM_MEMORY_GROW_SIZE = 0u;
 
 
     static const uint32_t VM_STACK_FREE_PAGE_SIZE = 8u;
+    // frames and registers in one contiguous region instead of random pages.
+    static const bool VM_STACK_LINEAR = false;
+    // the linear stack grows by segments of this size.
+    static const uint64_t VM_LINEAR_STACK_SEGMENT_SIZE = 256UL << 10U;
+    // vm frames alive at once, StackOverflowError beyond it.
+    static const uint32_t VM_STACK_MAX_DEPTH = 2048u;
+
+    // the pool of Vm::callMethodAsync, and the calls waiting in it before one is refused.
+    static const uint32_t VM_WORKER_THREAD_COUNT = 2u;
+    static const uint32_t VM_WORKER_QUEUE_DEPTH = 64u;
+
+    // calls of one Vm::callMethodBatch made by ShellApplication.callMethodBatch,
+    // bounds the local refs of the arguments held at once.
+    static const uint32_t VM_BATCH_CHUNK_SIZE = 128u;
+
+    // jni local reference frame of every vm frame.
+    static const uint32_t VM_LOCAL_FRAME_CAPACITY = 16u;
+    // reclaim the dead local references every N backward branches.
+    static const uint32_t VM_LOCAL_FRAME_RECLAIM_PERIOD = 64u;
+
+    // over budget a call throws instead of logging, see VM_CALL_BUDGET_THROW.
+    static const bool VM_CALL_BUDGET_THROW_DEFAULT = true;
+
+    // primitive arrays cached by aget / aput, and bytes copied of each one.
+    static const uint32_t VM_ARRAY_CACHE_SIZE = 4u;
+    static const uint32_t VM_ARRAY_WINDOW_SIZE = 1024u;
+
+    // resolved constants kept by a critical trim, used this often since the last trim.
+    static const uint32_t VM_RESOLVE_CACHE_HOT_HITS = 16u;
+    // dex files resolved from, and the slots of the table of cached global refs (a power of 2).
+    static const uint32_t VM_RESOLVE_CACHE_DEX_FILES = 64u;
+    static const uint32_t VM_RESOLVE_CACHE_REF_SLOTS = 1u << 14u;
 };
 
 #define DEFINE_NAME_SIGN(VAR_NAME, NAME, SIGN)                                  \
@@ -185,6 +242,22 @@ struct VM_REFLECT {
                      "set",
                      "(Ljava/lang/Object;Ljava/lang/Object;)V");
 
+    DEFINE_NAME_SIGN(String_intern,
+                     "intern",
+                     "()Ljava/lang/String;");
+
+    DEFINE_NAME_SIGN(System_identityHashCode,
+                     "identityHashCode",
+                     "(Ljava/lang/Object;)I");
+
+    // unboxing the arguments of ShellApplication.callMethodBatch.
+    DEFINE_NAME_SIGN(Boolean_booleanValue, "booleanValue", "()Z");
+    DEFINE_NAME_SIGN(Character_charValue, "charValue", "()C");
+    DEFINE_NAME_SIGN(Number_intValue, "intValue", "()I");
+    DEFINE_NAME_SIGN(Number_longValue, "longValue", "()J");
+    DEFINE_NAME_SIGN(Number_floatValue, "floatValue", "()F");
+    DEFINE_NAME_SIGN(Number_doubleValue, "doubleValue", "()D");
+
 
 
 
@@ -204,6 +277,7 @@ struct VM_REFLECT {
     DEFINE_CLASS_NAME_SIGN(ProviderClientRecord,
                            "android/app/ActivityThread$ProviderClientRecord");
     DEFINE_CLASS_NAME_SIGN(ContentProvider, "android/content/ContentProvider");
+    DEFINE_CLASS_NAME_SIGN(Object, "java/lang/Object");
     DEFINE_CLASS_NAME_SIGN(Class, "java/lang/Class");
     DEFINE_CLASS_NAME_SIGN(NullPointerException, "java/lang/NullPointerException");
     DEFINE_CLASS_NAME_SIGN(ClassCastException, "java/lang/ClassCastException");
@@ -211,9 +285,19 @@ struct VM_REFLECT {
                            "java/lang/NegativeArraySizeException");
     DEFINE_CLASS_NAME_SIGN(RuntimeException, "java/lang/RuntimeException");
     DEFINE_CLASS_NAME_SIGN(InternalError, "java/lang/InternalError");
+    DEFINE_CLASS_NAME_SIGN(StackOverflowError, "java/lang/StackOverflowError");
     DEFINE_CLASS_NAME_SIGN(ArrayIndexOutOfBoundsException,
                            "java/lang/ArrayIndexOutOfBoundsException");
     DEFINE_CLASS_NAME_SIGN(ArithmeticException, "java/lang/ArithmeticException");
+    DEFINE_CLASS_NAME_SIGN(IllegalArgumentException, "java/lang/IllegalArgumentException");
+    DEFINE_CLASS_NAME_SIGN(Boolean, "java/lang/Boolean");
+    DEFINE_CLASS_NAME_SIGN(Character, "java/lang/Character");
+    DEFINE_CLASS_NAME_SIGN(Number, "java/lang/Number");
+    DEFINE_CLASS_NAME_SIGN(CancellationException,
+                           "java/util/concurrent/CancellationException");
+    DEFINE_CLASS_NAME_SIGN(String, "java/lang/String");
+    DEFINE_CLASS_NAME_SIGN(System, "java/lang/System");
+    DEFINE_CLASS_NAME_SIGN(ArrayList, "java/util/ArrayList");
 
 };
 
@@ -76,6 +76,8 @@ bool JavaException::handleJavaException(VmMethodContext *vmc) {
         vmc->set_pc(catchOff);
         // remove the exception.
         vmc->curException = nullptr;
+        // the handler never resumes a call left by the throwing instruction.
+        vmc->run();
         return true;
     }
 }
@@ -128,6 +130,12 @@ void JavaException::throwInternalError(VmMethodContext *vmc, const char *msg) {
     JavaException::throwNew(vmc, VM_REFLECT::C_NAME_InternalError, msg);
 }
 
+void JavaException::throwStackOverflowError(VmMethodContext *vmc, u4 depth) {
+    char msgBuf[BUFSIZ];
+    sprintf(msgBuf, "vm stack depth=%u", depth);
+    JavaException::throwNew(vmc, VM_REFLECT::C_NAME_StackOverflowError, msgBuf);
+}
+
 void JavaException::throwArrayIndexOutOfBoundsException(VmMethodContext *vmc, u4 length, u4 index) {
     char msgBuf[BUFSIZ];
     sprintf(msgBuf, "length=%d; index=%d", length, index);
@@ -136,4 +144,8 @@ void JavaException::throwArrayIndexOutOfBoundsException(VmMethodContext *vmc, u4
 
 void JavaException::throwArithmeticException(VmMethodContext *vmc, const char *msg) {
     JavaException::throwNew(vmc, VM_REFLECT::C_NAME_ArithmeticException, msg);
+}
+
+void JavaException::throwCancellationException(VmMethodContext *vmc, const char *msg) {
+    JavaException::throwNew(vmc, VM_REFLECT::C_NAME_CancellationException, msg);
 }
\ No newline at end of file
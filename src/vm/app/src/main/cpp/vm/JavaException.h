@@ -26,10 +26,14 @@ public:
 
     static void throwInternalError(VmMethodContext *vmc, const char *msg);
 
+    static void throwStackOverflowError(VmMethodContext *vmc, u4 depth);
+
     static void throwArrayIndexOutOfBoundsException(VmMethodContext *vmc, u4 length, u4 index);
 
     static void throwArithmeticException(VmMethodContext *vmc, const char *msg);
 
+    static void throwCancellationException(VmMethodContext *vmc, const char *msg);
+
 private:
     static void throwNew(VmMethodContext *vmc, const char *exceptionClassName, const char *msg);
 };
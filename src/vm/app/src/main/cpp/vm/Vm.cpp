@@ -7,17 +7,221 @@
 #include "../common/VmConstant.h"
 #include "../VmContext.h"
 #include "JavaException.h"
+#include "base/VmRandom.h"
 #include <cmath>
+#include <thread>
+#include <unistd.h>
+
+// set in runningThreads while the resolve cache is trimmed.
+static const uint32_t kTrimmingThreads = 0x80000000u;
+
+thread_local std::unique_ptr<VmThreadContext> Vm::threadContext;
+
+static inline uint64_t nowNanos() {
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
 
 void Vm::callMethod(jobject instance, jmethodID method, jvalue *pResult, ...) {
     va_list args;
     va_start(args, pResult);
-    // init vm method context
-    VM_CONTEXT::vm->push(instance, method, pResult, args);
+    Vm::callMethodV(instance, method, pResult, args);
     va_end(args);
+}
+
+void Vm::callMethodV(jobject instance, jmethodID method, jvalue *pResult, va_list args) {
+    Vm *vm = VM_CONTEXT::vm;
+    if (!vm->enterCall(pResult)) {
+        return;
+    }
+    // init vm method context
+    vm->push(instance, method, pResult, args);
     // do it
-    VM_CONTEXT::vm->run();
-    VM_CONTEXT::vm->pop();
+    vm->run();
+    vm->pop();
+    vm->leaveCall();
+}
+
+void Vm::callMethodA(jobject instance, jmethodID method, jvalue *pResult, const jvalue *args) {
+    Vm *vm = VM_CONTEXT::vm;
+    if (!vm->enterCall(pResult)) {
+        return;
+    }
+    vm->pushWithoutParams(method, pResult);
+    vm->getCurVMC()->pushParams(instance, args);
+    vm->run();
+    vm->pop();
+    vm->leaveCall();
+}
+
+uint32_t Vm::callMethodBatch(jobject instance, jmethodID method, const jvalue *args,
+                             uint32_t count, jvalue *results) {
+    Vm *vm = VM_CONTEXT::vm;
+    if (count == 0 || !vm->enterCall(results)) {
+        return 0;
+    }
+    vm->pushWithoutParams(method, results);
+    VmMethodContext *vmc = vm->getCurVMC();
+    const uint32_t paramCount = strlen(vmc->method->getShorty()) - 1;
+    uint32_t done = 0;
+    while (true) {
+        vmc->pushParams(instance, args + done * paramCount);
+        vm->run();
+        if (vmc->curException != nullptr) {
+            break;
+        }
+        if (++done == count) {
+            break;
+        }
+        vm->resetBatchFrame(vmc, results + done);
+    }
+    vm->pop();
+    vm->leaveCall();
+    return done;
+}
+
+std::future<VmAsyncResult> Vm::callMethodAsync(
+        jobject instance, jmethodID method, const jvalue *args, VmAsyncCallback callback) {
+    JNIEnv *env = VM_CONTEXT::attachCurrentThread();
+    VmMethod vmMethod{};
+    const std::string shorty = vmMethod.reset(method)->getShorty();
+    const bool isStatic = DexFile::isStaticMethod(vmMethod.accessFlags);
+    // the local refs of the caller are no use on a worker.
+    jobject globalInstance = isStatic ? nullptr : (*env).NewGlobalRef(instance);
+    std::vector<jvalue> params(args, args + shorty.size() - 1);
+    for (uint32_t i = 1; i < shorty.size(); i++) {
+        if (shorty[i] == 'L' && params[i - 1].l != nullptr) {
+            params[i - 1].l = (*env).NewGlobalRef(params[i - 1].l);
+        }
+    }
+    auto promise = std::make_shared<std::promise<VmAsyncResult>>();
+    std::future<VmAsyncResult> ret = promise->get_future();
+
+    auto release = [globalInstance, params, shorty]() {
+        JNIEnv *env = VM_CONTEXT::env;
+        if (globalInstance != nullptr) {
+            (*env).DeleteGlobalRef(globalInstance);
+        }
+        for (uint32_t i = 1; i < shorty.size(); i++) {
+            if (shorty[i] == 'L' && params[i - 1].l != nullptr) {
+                (*env).DeleteGlobalRef(params[i - 1].l);
+            }
+        }
+    };
+    auto task = [globalInstance, method, params, shorty, promise, callback, release]() {
+        JNIEnv *env = VM_CONTEXT::env;
+        VmAsyncResult result{false, {}, nullptr};
+        // a worker never returns to java, its local refs go with this frame.
+        if ((*env).PushLocalFrame(VM_CONFIG::VM_LOCAL_FRAME_CAPACITY) == 0) {
+            try {
+                Vm::callMethodA(globalInstance, method, &result.val, params.data());
+                result.isDone = true;
+            } catch (const std::exception &e) {
+                LOG_E("vm async call failed: %s", e.what());
+                VM_CONTEXT::vm->abortCalls();
+            }
+            jthrowable exception = (*env).ExceptionOccurred();
+            if (exception != nullptr) {
+                (*env).ExceptionClear();
+                result.exception = (jthrowable) (*env).NewGlobalRef(exception);
+            }
+            if (result.isDone && shorty[0] == 'L' && result.val.l != nullptr) {
+                result.val.l = (*env).NewGlobalRef(result.val.l);
+            }
+            (*env).PopLocalFrame(nullptr);
+        } else {
+            LOG_E("can't push the jni local frame of a vm async call.");
+            (*env).ExceptionClear();
+        }
+        release();
+        if (callback != nullptr) {
+            callback(result);
+        }
+        promise->set_value(result);
+    };
+    if (!VM_CONTEXT::vm->getWorkerPool()->submit(task)) {
+        release();
+        VmAsyncResult result{false, {}, nullptr};
+        if (callback != nullptr) {
+            callback(result);
+        }
+        promise->set_value(result);
+    }
+    return ret;
+}
+
+bool Vm::enterCall(jvalue *pResult) {
+    // a key function may be called on any thread.
+    VM_CONTEXT::attachCurrentThread();
+    VmThreadContext *thread = this->curThread();
+    if (this->isStackFull()) {
+        JNIEnv *env = VM_CONTEXT::env;
+        LOG_E("vm stack overflow, depth: %u", thread->depth);
+        pResult->j = 0;
+        (*env).ThrowNew((*env).FindClass(VM_REFLECT::C_NAME_StackOverflowError),
+                        "vm stack overflow");
+        return false;
+    }
+    if (thread->depth == 0) {
+        this->beginRunning();
+        thread->methodTempData.hasBudget = thread->budget.isEnabled();
+        if (thread->methodTempData.hasBudget) {
+            thread->budgetBackEdges = 0;
+            thread->budgetStart = nowNanos();
+        }
+    }
+    return true;
+}
+
+void Vm::abortCalls() {
+    VmThreadContext *thread = this->curThread();
+    if (thread->depth == 0) {
+        return;
+    }
+    while (thread->depth != 0) {
+        this->pop();
+    }
+    this->leaveCall();
+}
+
+void Vm::leaveCall() {
+    // back to the outermost caller, a good time to give pages back.
+    VmThreadContext *thread = this->curThread();
+    if (thread->depth == 0) {
+        thread->methodTempData.hasBudget = false;
+        this->endRunning();
+        this->vmMemory->trim();
+    }
+}
+
+VmCallBudget Vm::setCallBudget(VmCallBudget budget) {
+    VmThreadContext *thread = VM_CONTEXT::vm->curThread();
+    std::swap(thread->budget, budget);
+    return budget;
+}
+
+void Vm::chargeBudget(VmMethodContext *vmc, uint32_t backEdges) {
+    VmThreadContext *thread = this->curThread();
+    const VmCallBudget &budget = thread->budget;
+    thread->budgetBackEdges += backEdges;
+    const uint64_t elapsed = nowNanos() - thread->budgetStart;
+    if ((budget.maxBackEdges == 0 || thread->budgetBackEdges < budget.maxBackEdges) &&
+        (budget.maxNanos == 0 || elapsed < budget.maxNanos)) {
+        return;
+    }
+    VmBudgetInfo info{vmc, thread->budgetBackEdges, elapsed, thread->depth};
+    if (budget.onExhausted != nullptr && budget.onExhausted(info)) {
+        thread->budgetBackEdges = 0;
+        thread->budgetStart = nowNanos();
+        return;
+    }
+    // the budget is not renewed, a caught exception is thrown again soon.
+    char msgBuf[BUFSIZ];
+    snprintf(msgBuf, sizeof(msgBuf), "vm call over budget, back-edges: %llu, elapsed: %llu us",
+             (unsigned long long) info.backEdges, (unsigned long long) (elapsed / 1000u));
+    LOG_W("%s, depth: %u, pc: 0x%x", msgBuf, info.depth, vmc->pc_cur());
+    JavaException::throwCancellationException(vmc, msgBuf);
 }
 
 void Vm::run() {
@@ -46,7 +250,11 @@ void Vm::run() {
                 LOG_D_VM("invoke a new function by VmKeyMethodCaller.");
                 // push the VmMethodContext and
                 // build new method's context which is to called.
-                this->keyMethodCaller->call(this->getCurVMC());
+                if (!this->keyMethodCaller->call(this->getCurVMC())) {
+                    // the exception goes to a handler or to the caller, the
+                    // invoke is not run again.
+                    continue;
+                }
 #if defined(VM_DEBUG_FULL)
                 this->getCurVMC()->printMethodInsns();
 #endif
@@ -87,6 +295,16 @@ jclass Vm::findPrimitiveClass(const char type) const {
     throw VMException(std::string("Unknown primitive type: ") + type);
 }
 
+jclass Vm::findPrimitiveArrayClass(const char type) const {
+    for (int i = 0; i < PRIMITIVE_TYPE_SIZE; i++) {
+        if (this->primitiveType[i] == type) {
+            return this->primitiveArrayClass[i];
+        }
+    }
+    LOG_E("Unknown primitive type '%c'", type);
+    throw VMException(std::string("Unknown primitive type: ") + type);
+}
+
 void Vm::initPrimitiveClass() {
     LOG_D_VM("init primitiveClass start");
     char type[3] = {'[', ' ', '\0'};
@@ -101,12 +319,16 @@ void Vm::initPrimitiveClass() {
                 cClass,
                 VM_REFLECT::NAME_Class_getComponentType,
                 VM_REFLECT::SIGN_Class_getComponentType);
-        this->primitiveClass[i] = (jclass) (*env).CallObjectMethod(cArray, mGetComponentType);
-        assert(this->primitiveClass[i] != nullptr);
+        jobject cPrimitive = (*env).CallObjectMethod(cArray, mGetComponentType);
+        assert(cPrimitive != nullptr);
+        // used by every vm frame, so it must outlive the local frame of JNI_OnLoad.
+        this->primitiveClass[i] = (jclass) (*env).NewGlobalRef(cPrimitive);
+        this->primitiveArrayClass[i] = (jclass) (*env).NewGlobalRef(cArray);
         LOG_D_VM("get jclass: %s, finish.", type);
-//        (*env).DeleteLocalRef(cArray);
+        (*env).DeleteLocalRef(cPrimitive);
+        (*env).DeleteLocalRef(cArray);
     }
-//    (*env).DeleteLocalRef(cClass);
+    (*env).DeleteLocalRef(cClass);
     LOG_D_VM("init primitiveClass end");
 }
 
@@ -115,19 +337,222 @@ bool Vm::isKeyFunction(uint32_t methodId) {
 }
 
 void Vm::push(jobject caller, jmethodID method, jvalue *pResult, va_list param) {
-    this->vmStack->push(caller, method, pResult, param);
+    assert(!this->isStackFull());
+    VmThreadContext *thread = this->curThread();
+    Vm::pushLocalFrame();
+    VmFrame *pre = thread->vmStack->getTopFrame();
+    try {
+        thread->vmStack->push(caller, method, pResult, param);
+    } catch (...) {
+        this->abortPush(pre);
+        throw;
+    }
+    // only a frame on the stack is counted, abortCalls pops depth frames.
+    thread->depth++;
 }
 
 void Vm::pushWithoutParams(jmethodID method, jvalue *pResult) {
-    this->vmStack->pushWithoutParams(method, pResult);
+    assert(!this->isStackFull());
+    VmThreadContext *thread = this->curThread();
+    Vm::pushLocalFrame();
+    VmFrame *pre = thread->vmStack->getTopFrame();
+    try {
+        thread->vmStack->pushWithoutParams(method, pResult);
+    } catch (...) {
+        this->abortPush(pre);
+        throw;
+    }
+    thread->depth++;
+}
+
+void Vm::abortPush(VmFrame *pre) {
+    VmThreadContext *thread = this->curThread();
+    if (thread->vmStack->getTopFrame() != pre) {
+        // the frame is on the stack, its params failed: pop it as any other.
+        thread->depth++;
+        return;
+    }
+    // no frame owns the local frame and the array cache frame pushed for it.
+    thread->arrayCache->leaveFrame();
+    (*VM_CONTEXT::env).PopLocalFrame(nullptr);
+    thread->methodTempData.refEpoch++;
+    thread->methodTempData.epoch++;
 }
 
 void Vm::pop() {
-    this->vmStack->pop();
+    // keep the exception or the returned object alive in the caller's local frame.
+    VmThreadContext *thread = this->curThread();
+    VmMethodContext *vmc = this->getCurVMC();
+    thread->arrayCache->leaveFrame();
+    if (vmc->curException != nullptr) {
+        vmc->curException = (jthrowable) (*VM_CONTEXT::env).PopLocalFrame(vmc->curException);
+    } else if (vmc->isFinish() && vmc->method->getShorty()[0] == 'L') {
+        vmc->retVal->l = (*VM_CONTEXT::env).PopLocalFrame(vmc->retVal->l);
+    } else {
+        (*VM_CONTEXT::env).PopLocalFrame(nullptr);
+    }
+    thread->methodTempData.refs.resize(vmc->refBase());
+    thread->methodTempData.refEpoch++;
+    thread->methodTempData.epoch++;
+    thread->vmStack->pop();
+    thread->depth--;
+}
+
+void Vm::pushLocalFrame() {
+    // every vm frame owns a jni local frame, see VmMethodContext::reclaimLocalRefs.
+    if ((*VM_CONTEXT::env).PushLocalFrame(VM_CONFIG::VM_LOCAL_FRAME_CAPACITY) < 0) {
+        LOG_E("can't push the jni local frame.");
+        throw VMException("can't push the jni local frame.");
+    }
+    VmThreadContext *thread = this->curThread();
+    thread->arrayCache->enterFrame();
+    // backEdges goes on across frames, a loop calling a key function still
+    // reaches the reclamation and the budget check.
+    thread->methodTempData.refEpoch++;
+    thread->methodTempData.epoch++;
+}
+
+void Vm::resetBatchFrame(VmMethodContext *vmc, jvalue *pResult) {
+    VmThreadContext *thread = this->curThread();
+    thread->arrayCache->leaveFrame();
+    if (vmc->method->getShorty()[0] == 'L') {
+        vmc->retVal->l = (*VM_CONTEXT::env).PopLocalFrame(vmc->retVal->l);
+    } else {
+        (*VM_CONTEXT::env).PopLocalFrame(nullptr);
+    }
+    thread->methodTempData.refs.resize(vmc->refBase());
+    Vm::pushLocalFrame();
+    // the VmMethod and the registers stay, bind only clears them.
+    vmc->bind(vmc->method, vmc->reg, pResult);
 }
 
 VmTempData *Vm::getTempDataBuf() {
-    return &this->methodTempData;
+    return &this->curThread()->methodTempData;
+}
+
+VmThreadContext *Vm::newThreadContext() const {
+    assert(Vm::threadContext == nullptr);
+    Vm::threadContext.reset(new VmThreadContext(
+            this->linearStack, this->vmMemory, this->defaultBudget));
+    LOG_I("new vm thread context: %p, tid: %d", Vm::threadContext.get(), gettid());
+    return Vm::threadContext.get();
+}
+
+VmThreadContext::VmThreadContext(bool isLinearStack, VmMemory *vmMemory,
+                                 const VmCallBudget &budget) : budget(budget) {
+    if (isLinearStack) {
+        this->vmStack = new VmLinearStack(VM_CONFIG::VM_LINEAR_STACK_SEGMENT_SIZE);
+    } else {
+        this->vmStack = new VmRandomStack(VM_CONFIG::VM_STACK_FREE_PAGE_SIZE, vmMemory);
+    }
+    this->vmCache = new VmLinearCache(vmMemory);
+    this->arrayCache = new VmArrayCache();
+}
+
+VmThreadContext::~VmThreadContext() {
+    assert(this->depth == 0);
+    delete this->vmStack;
+    delete this->vmCache;
+    delete this->arrayCache;
+}
+
+bool Vm::isLinearStack() {
+    VDF_KeyValueData policy;
+    if (VM_CONTEXT::vmDataFile != nullptr &&
+        VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_STACK_POLICY, policy)) {
+        LOG_I("vm stack policy: %s", policy.getVal());
+        return strcmp(policy.getVal(), "linear") == 0;
+    }
+    return VM_CONFIG::VM_STACK_LINEAR;
+}
+
+uint32_t Vm::findMaxDepth() {
+    VDF_KeyValueData maxDepth;
+    if (VM_CONTEXT::vmDataFile != nullptr &&
+        VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_STACK_DEPTH, maxDepth)) {
+        LOG_I("vm stack max depth: %s", maxDepth.getVal());
+        uint32_t ret = strtoul(maxDepth.getVal(), nullptr, 10);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return VM_CONFIG::VM_STACK_MAX_DEPTH;
+}
+
+uint32_t Vm::findWorkerThreads() {
+    VDF_KeyValueData threads;
+    if (VM_CONTEXT::vmDataFile != nullptr &&
+        VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_WORKER_THREADS, threads)) {
+        LOG_I("vm worker threads: %s", threads.getVal());
+        uint32_t ret = strtoul(threads.getVal(), nullptr, 10);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return VM_CONFIG::VM_WORKER_THREAD_COUNT;
+}
+
+VmCallBudget Vm::findCallBudget() {
+    VmCallBudget budget;
+    if (VM_CONTEXT::vmDataFile == nullptr) {
+        return budget;
+    }
+    VDF_KeyValueData val;
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_CALL_BUDGET_BACK_EDGES, val)) {
+        LOG_I("vm call budget back-edges: %s", val.getVal());
+        budget.maxBackEdges = strtoull(val.getVal(), nullptr, 10);
+    }
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_CALL_BUDGET_MS, val)) {
+        LOG_I("vm call budget: %s ms", val.getVal());
+        budget.maxNanos = strtoull(val.getVal(), nullptr, 10) * 1000000u;
+    }
+    bool isThrow = VM_CONFIG::VM_CALL_BUDGET_THROW_DEFAULT;
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_CALL_BUDGET_THROW, val)) {
+        LOG_I("vm call budget throw: %s", val.getVal());
+        isThrow = strcmp(val.getVal(), "true") == 0;
+    }
+    if (!isThrow) {
+        budget.onExhausted = [](const VmBudgetInfo &info) {
+            LOG_W("vm call over budget, back-edges: %llu, elapsed: %llu us, depth: %u, pc: 0x%x",
+                  (unsigned long long) info.backEdges,
+                  (unsigned long long) (info.elapsedNanos / 1000u),
+                  info.depth, info.vmc->pc_cur());
+            return true;
+        };
+    }
+    return budget;
+}
+
+VmWorkerPool *Vm::getWorkerPool() {
+    std::call_once(this->workerPoolOnce, [this]() {
+        this->workerPool = new VmWorkerPool(
+                Vm::findWorkerThreads(), VM_CONFIG::VM_WORKER_QUEUE_DEPTH);
+    });
+    return this->workerPool;
+}
+
+VmMemoryOptions Vm::findMemoryOptions() {
+    VmMemoryOptions options;
+    options.prefaultSize = VM_CONFIG::VM_MEMORY_PREFAULT_SIZE;
+    options.hugePages = VM_CONFIG::VM_MEMORY_USE_HUGE_PAGE;
+    options.growSize = VM_CONFIG::VM_MEMORY_GROW_SIZE;
+    if (VM_CONTEXT::vmDataFile == nullptr) {
+        return options;
+    }
+    VDF_KeyValueData val;
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_MEMORY_PREFAULT, val)) {
+        LOG_I("vm memory prefault: %s KB", val.getVal());
+        options.prefaultSize = strtoull(val.getVal(), nullptr, 10) << 10u;
+    }
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_MEMORY_HUGE_PAGE, val)) {
+        LOG_I("vm memory huge page: %s", val.getVal());
+        options.hugePages = strcmp(val.getVal(), "true") == 0;
+    }
+    if (VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_MEMORY_GROW, val)) {
+        LOG_I("vm memory grow: %s KB", val.getVal());
+        options.growSize = strtoull(val.getVal(), nullptr, 10) << 10u;
+    }
+    return options;
 }
 
 void Vm::init() {
@@ -135,15 +560,20 @@ void Vm::init() {
     static_assert(sizeof(VmFrame) <= 64u, "too big of VmFrame.");
     // TODO: change vm.Interpret.
     this->interpret = nullptr;
+    VDF_KeyValueData seed;
+    if (VM_CONTEXT::vmDataFile != nullptr &&
+        VM_CONTEXT::vmDataFile->findValByKey(VM_CONFIG::VM_RANDOM_SEED, seed)) {
+        LOG_I("vm random seed: %s", seed.getVal());
+        VmRandom::seed(strtoull(seed.getVal(), nullptr, 10));
+    }
     LOG_I("init this->vmMemory, start.");
-    this->vmMemory = new VmRandomMemory(VM_CONFIG::VM_MEMORY_SIZE);
+    this->vmMemory = new VmRandomMemory(VM_CONFIG::VM_MEMORY_SIZE, Vm::findMemoryOptions());
     LOG_I("init this->vmMemory: %p, finish.", this->vmMemory);
-    LOG_I("init this->vmStack, start.");
-    this->vmStack = new VmRandomStack(VM_CONFIG::VM_STACK_FREE_PAGE_SIZE, this->vmMemory);
-    LOG_I("init this->vmStack: %p, finish.", this->vmStack);
-    LOG_I("init this->vmCache, start.");
-    this->vmCache = new VmLinearCache(this->vmMemory);
-    LOG_I("init this->vmCache: %p, finish.", this->vmCache);
+    // the stack and the cache of every thread are made by curThread.
+    this->maxDepth = Vm::findMaxDepth();
+    this->defaultBudget = Vm::findCallBudget();
+    this->linearStack = Vm::isLinearStack();
+    this->resolveCache = new VmResolveCache();
 
     // method's caller
     LOG_I("init method's caller, start.");
@@ -156,22 +586,99 @@ void Vm::init() {
 }
 
 Vm::~Vm() {
+    // the workers still use everything below.
+    delete this->workerPool;
+    for (auto &it : this->primitiveClass) {
+        (*VM_CONTEXT::env).DeleteGlobalRef(it);
+    }
+    for (auto &it : this->primitiveArrayClass) {
+        (*VM_CONTEXT::env).DeleteGlobalRef(it);
+    }
     delete this->interpret;
-    delete this->vmStack;
-    delete this->vmCache;
+    // the calling thread's context goes before the arena its pages come from.
+    Vm::threadContext.reset();
+    delete this->resolveCache;
     delete this->vmMemory;
     delete this->keyMethodCaller;
     delete this->jniMethodCaller;
 }
 
-uint8_t *Vm::mallocCache(uint32_t key, uint32_t count) {
-    return this->vmCache->mallocCache(key, count);
+uint8_t *Vm::mallocCache(VmCacheType *type, uint32_t count) {
+    return this->curThread()->vmCache->mallocCache(type, count);
+}
+
+void Vm::freeCache(VmCacheType *type, uint32_t count) {
+    this->curThread()->vmCache->freeCache(type, count);
+}
+
+VmCacheType *Vm::newCacheType(uint32_t bufSize) {
+    return this->curThread()->vmCache->newCacheType(bufSize);
+}
+
+// the stats and the trims of a thread which never ran the vm don't make it a context.
+VmStackStats Vm::getStackStats() const {
+    VmThreadContext *thread = Vm::threadContext.get();
+    return thread != nullptr ? thread->vmStack->getStackStats() : VmStackStats{};
+}
+
+std::vector<VmCacheTypeStats> Vm::getCacheStats() const {
+    VmThreadContext *thread = Vm::threadContext.get();
+    return thread != nullptr ? thread->vmCache->getCacheStats() : std::vector<VmCacheTypeStats>();
+}
+
+void Vm::trimStack() {
+    VmThreadContext *thread = Vm::threadContext.get();
+    if (thread != nullptr) {
+        thread->vmStack->trimStack();
+    }
+}
+
+void Vm::trimCache() {
+    VmThreadContext *thread = Vm::threadContext.get();
+    if (thread != nullptr) {
+        thread->vmCache->trimCache();
+    }
+}
+
+void Vm::trimMemory(VmTrimLevel level) {
+    LOG_I("vm trim memory, level: %u, running threads: %u",
+          (uint32_t) level, this->runningThreads.load());
+    if (level >= VmTrimLevel::Moderate) {
+        // only the calling thread's stack and cache, the others are in use.
+        this->trimStack();
+        this->trimCache();
+        // the registers of a live frame may hold the cached global refs.
+        uint32_t idle = 0;
+        if (this->runningThreads.compare_exchange_strong(idle, kTrimmingThreads)) {
+            this->resolveCache->trim(level == VmTrimLevel::Critical
+                                     ? VM_CONFIG::VM_RESOLVE_CACHE_HOT_HITS : 1u);
+            this->runningThreads.store(0, std::memory_order_release);
+        }
+    }
+    // the stack and the cache gave their empty pages to the arena.
+    this->vmMemory->release(level == VmTrimLevel::Light ? VM_CONFIG::VM_MEMORY_FREE_PAGE_LOW : 0u);
+}
+
+void Vm::beginRunning() {
+    uint32_t count = this->runningThreads.load(std::memory_order_acquire);
+    do {
+        // the readers of the resolve cache take no lock, they wait for a trim here.
+        while ((count & kTrimmingThreads) != 0) {
+            std::this_thread::yield();
+            count = this->runningThreads.load(std::memory_order_acquire);
+        }
+    } while (!this->runningThreads.compare_exchange_weak(
+            count, count + 1, std::memory_order_acq_rel, std::memory_order_acquire));
 }
 
-void Vm::freeCache(uint32_t key, uint32_t count) {
-    this->vmCache->freeCache(key, count);
+void Vm::endRunning() {
+    this->runningThreads.fetch_sub(1, std::memory_order_release);
 }
 
-uint32_t Vm::newCacheType(uint32_t bufSize) {
-    return this->vmCache->newCacheType(bufSize);
+VmStats Vm::getStats() const {
+    VmStats stats;
+    stats.memory = this->vmMemory->getStats();
+    stats.stack = this->getStackStats();
+    stats.cache = this->getCacheStats();
+    return stats;
 }
@@ -7,43 +7,200 @@
 
 #include <jni.h>
 #include <string>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include "base/VmMethod.h"
 #include "interpret/Interpret.h"
 #include "base/VmStack.h"
 #include "base/VmCache.h"
 #include "base/VmMemory.h"
+#include "base/VmResolveCache.h"
+#include "base/VmArrayCache.h"
+#include "VmWorkerPool.h"
 
 #define  PRIMITIVE_TYPE_SIZE 8
 
+// a snapshot of the vm memory, see Vm::getStats.
+struct VmStats {
+    // the arena, shared by every thread.
+    VmMemoryStats memory;
+    // of the calling thread only, zero if it never ran the vm.
+    VmStackStats stack;
+    std::vector<VmCacheTypeStats> cache;
+};
+
+/**
+ * the end of a Vm::callMethodAsync. val.l and exception are global refs,
+ * deleted by the receiver.
+ */
+struct VmAsyncResult {
+    // false if the call was refused by a full queue or the vm faulted.
+    bool isDone;
+    jvalue val;
+    // thrown by the key function and not caught.
+    jthrowable exception;
+};
+
+// runs on the worker thread, attached to the java vm, or on the caller if the call is refused.
+typedef std::function<void(const VmAsyncResult &)> VmAsyncCallback;
+
+// where a call ran out of its budget, see VmCallBudget.
+struct VmBudgetInfo {
+    // the frame taking the backward branch.
+    VmMethodContext *vmc;
+    uint64_t backEdges;
+    uint64_t elapsedNanos;
+    // vm frames alive.
+    uint32_t depth;
+};
+
+// true goes on with a fresh budget, false throws a CancellationException.
+typedef std::function<bool(const VmBudgetInfo &)> VmBudgetCallback;
+
+/**
+ * bounds the outermost call of a thread and everything it calls, checked
+ * every VM_LOCAL_FRAME_RECLAIM_PERIOD backward branches. 0 is no limit.
+ */
+struct VmCallBudget {
+    uint64_t maxBackEdges = 0;
+    uint64_t maxNanos = 0;
+    // runs on the calling thread, nullptr throws.
+    VmBudgetCallback onExhausted = nullptr;
+
+    inline bool isEnabled() const {
+        return this->maxBackEdges != 0 || this->maxNanos != 0;
+    }
+};
+
+/**
+ * what one thread runs vm frames with, made on its first call into the vm.
+ * the decoded code, the resolve cache and the memory arena are shared.
+ */
+struct VmThreadContext {
+    VmStack *vmStack;
+    VmCache *vmCache;
+    VmArrayCache *arrayCache;
+
+    // tmp data
+    VmTempData methodTempData;
+
+    // vm frames alive.
+    uint32_t depth = 0;
+
+    // of the calls this thread starts, see Vm::setCallBudget.
+    VmCallBudget budget;
+    // spent by the outermost call running.
+    uint64_t budgetBackEdges = 0;
+    uint64_t budgetStart = 0;
+
+    VmThreadContext(bool isLinearStack, VmMemory *vmMemory, const VmCallBudget &budget);
+
+    ~VmThreadContext();
+};
+
 class Vm : public VmStack, public VmCache {
 private:
     Interpret *interpret;
 
     VmMemory *vmMemory;
-    VmStack *vmStack;
-    VmCache* vmCache;
+    VmResolveCache *resolveCache;
 
     VmMethodCaller *keyMethodCaller;
     VmMethodCaller *jniMethodCaller;
 
-    // tmp data
-    VmTempData methodTempData;
+    // made by the first callMethodAsync.
+    VmWorkerPool *workerPool = nullptr;
+    std::once_flag workerPoolOnce;
+
+    static thread_local std::unique_ptr<VmThreadContext> threadContext;
+    bool linearStack = VM_CONFIG::VM_STACK_LINEAR;
+    // threads with vm frames alive, kTrimmingThreads while the resolve cache is trimmed.
+    std::atomic<uint32_t> runningThreads{0};
+
+    uint32_t maxDepth = VM_CONFIG::VM_STACK_MAX_DEPTH;
+    // of every new thread, from the vm data.
+    VmCallBudget defaultBudget;
 
 public:
+    // the context of the calling thread.
+    inline VmThreadContext *curThread() const {
+        VmThreadContext *ret = Vm::threadContext.get();
+        return ret != nullptr ? ret : this->newThreadContext();
+    }
+
     VmTempData *getTempDataBuf();
 
+    inline VmResolveCache *getResolveCache() {
+        return this->resolveCache;
+    }
+
+    inline VmArrayCache *getArrayCache() {
+        return this->curThread()->arrayCache;
+    }
+
+    // checked before every push.
+    inline bool isStackFull() const {
+        return this->curThread()->depth >= this->maxDepth;
+    }
+
+    inline uint32_t getDepth() const {
+        return this->curThread()->depth;
+    }
+
     inline VmMethodContext *getCurVMC() {
-        return &this->vmStack->getTopFrame()->vmc;
+        return &this->curThread()->vmStack->getTopFrame()->vmc;
     }
 
     inline bool isCallFromVm() {
-        VmFrame *pre = this->vmStack->getTopFrame()->pre;
+        VmFrame *pre = this->curThread()->vmStack->getTopFrame()->pre;
         return pre != nullptr && pre->vmc.isCallFromVm();
     }
 
     static void
     callMethod(jobject instance, jmethodID method, jvalue *pResult, ...);
 
+    static void
+    callMethodV(jobject instance, jmethodID method, jvalue *pResult, va_list args);
+
+    // one jvalue per parameter, as the Call<type>MethodA of jni.
+    static void
+    callMethodA(jobject instance, jmethodID method, jvalue *pResult, const jvalue *args);
+
+    /**
+     * call a key function count times, args holds count tuples of one jvalue
+     * per parameter. The frame, the method and the registers are set up once
+     * and reused by every call, results gets one value per call, an object
+     * result is a local ref of the caller. Stops at the first call throwing,
+     * the exception is left pending.
+     * @return the calls which returned.
+     */
+    static uint32_t
+    callMethodBatch(jobject instance, jmethodID method, const jvalue *args, uint32_t count,
+                    jvalue *results);
+
+    /**
+     * run a key function on the worker pool, off a latency critical thread.
+     * instance and the object args are only used by this call, global refs
+     * of them are kept until it ends. The result goes to the future and to
+     * callback, a full queue refuses the call at once.
+     */
+    static std::future<VmAsyncResult> callMethodAsync(
+            jobject instance, jmethodID method, const jvalue *args,
+            VmAsyncCallback callback = nullptr);
+
+    /**
+     * the budget of the next outermost calls of this thread, a call already
+     * running keeps the old limits.
+     * @return the budget before.
+     */
+    static VmCallBudget setCallBudget(VmCallBudget budget);
+
+    // backEdges taken by the running call, checks its budget.
+    void chargeBudget(VmMethodContext *vmc, uint32_t backEdges);
+
     static bool isKeyFunction(uint32_t methodId);
 
     void init();
@@ -52,6 +209,8 @@ public:
 
     jclass findPrimitiveClass(const char type) const;
 
+    jclass findPrimitiveArrayClass(const char type) const;
+
     void setInterpret(Interpret *pInterpret);
 
     void run();
@@ -62,11 +221,24 @@ public:
 
     void pop() override;
 
-    uint8_t *mallocCache(uint32_t key, uint32_t count) override;
+    uint8_t *mallocCache(VmCacheType *type, uint32_t count) override;
+
+    void freeCache(VmCacheType *type, uint32_t count) override;
+
+    VmCacheType *newCacheType(uint32_t bufSize) override;
+
+    VmStackStats getStackStats() const override;
+
+    std::vector<VmCacheTypeStats> getCacheStats() const override;
+
+    VmStats getStats() const;
 
-    void freeCache(uint32_t key, uint32_t count) override;
+    void trimStack() override;
 
-    uint32_t newCacheType(uint32_t bufSize) override;
+    void trimCache() override;
+
+    // called on memory pressure, see ShellApplication.
+    void trimMemory(VmTrimLevel level);
 
 
 private:
@@ -82,9 +254,45 @@ private:
             'J'
     };
     jclass primitiveClass[PRIMITIVE_TYPE_SIZE]{};
+    jclass primitiveArrayClass[PRIMITIVE_TYPE_SIZE]{};
 private:
     void initPrimitiveClass();
 
+    void pushLocalFrame();
+
+    // undo a push whose stack push threw, pre is the top frame before it.
+    void abortPush(VmFrame *pre);
+
+    // as pop and push of the same method, the next call of callMethodBatch.
+    void resetBatchFrame(VmMethodContext *vmc, jvalue *pResult);
+
+    VmThreadContext *newThreadContext() const;
+
+    // around the outermost frame of a thread.
+    void beginRunning();
+
+    void endRunning();
+
+    // false and a StackOverflowError pending if no frame can be pushed.
+    bool enterCall(jvalue *pResult);
+
+    void leaveCall();
+
+    // pop the frames left by a VMException, the thread can run the vm again.
+    void abortCalls();
+
+    VmWorkerPool *getWorkerPool();
+
+    static uint32_t findWorkerThreads();
+
+    static VmCallBudget findCallBudget();
+
+    static bool isLinearStack();
+
+    static uint32_t findMaxDepth();
+
+    static VmMemoryOptions findMemoryOptions();
+
 };
 
 
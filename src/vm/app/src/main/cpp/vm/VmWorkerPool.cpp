@@ -0,0 +1,106 @@
+//
+// Created by 陈泽伦 on 1/16/21.
+//
+
+#include "VmWorkerPool.h"
+#include "../common/Util.h"
+#include "../VmContext.h"
+#include <unistd.h>
+
+thread_local int VmWorkerPool::curWorker = -1;
+
+VmWorkerPool::VmWorkerPool(uint32_t threadCount, uint32_t maxQueueDepth) :
+        maxQueueDepth(maxQueueDepth) {
+    assert(threadCount != 0);
+    for (uint32_t i = 0; i < threadCount; i++) {
+        this->workers.emplace_back(new Worker());
+    }
+    // every deque is there before a worker may steal from it.
+    for (uint32_t i = 0; i < threadCount; i++) {
+        this->workers[i]->thread = std::thread(&VmWorkerPool::runWorker, this, i);
+    }
+    LOG_I("vm worker pool, threads: %u, queue depth: %u", threadCount, maxQueueDepth);
+}
+
+VmWorkerPool::~VmWorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(this->idleLock);
+        this->isStopping = true;
+    }
+    this->idle.notify_all();
+    for (auto &it : this->workers) {
+        it->thread.join();
+    }
+}
+
+bool VmWorkerPool::submit(VmTask task) {
+    uint32_t depth = this->queueDepth.load(std::memory_order_relaxed);
+    do {
+        if (depth >= this->maxQueueDepth) {
+            LOG_W("vm worker queue is full, depth: %u", depth);
+            return false;
+        }
+    } while (!this->queueDepth.compare_exchange_weak(depth, depth + 1));
+
+    uint32_t idx = VmWorkerPool::curWorker >= 0
+                   ? (uint32_t) VmWorkerPool::curWorker
+                   : this->nextWorker.fetch_add(1, std::memory_order_relaxed) % this->workers.size();
+    Worker *worker = this->workers[idx].get();
+    {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        worker->tasks.push_back(std::move(task));
+        // counted before it can be taken.
+        this->pendingTasks++;
+    }
+    // under the lock, so a worker going to sleep can't miss it.
+    std::lock_guard<std::mutex> guard(this->idleLock);
+    this->idle.notify_one();
+    return true;
+}
+
+bool VmWorkerPool::takeTask(uint32_t idx, VmTask &task) {
+    const uint32_t count = this->workers.size();
+    for (uint32_t i = 0; i < count; i++) {
+        Worker *worker = this->workers[(idx + i) % count].get();
+        std::lock_guard<std::mutex> guard(worker->lock);
+        if (worker->tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            // the newest of its own, its data is likely still in the cache.
+            task = std::move(worker->tasks.back());
+            worker->tasks.pop_back();
+        } else {
+            // the oldest of another one, the owner works at the other end.
+            task = std::move(worker->tasks.front());
+            worker->tasks.pop_front();
+        }
+        this->pendingTasks--;
+        this->queueDepth--;
+        return true;
+    }
+    return false;
+}
+
+void VmWorkerPool::runWorker(uint32_t idx) {
+    VmWorkerPool::curWorker = idx;
+    // detached again when the thread exits.
+    VM_CONTEXT::attachCurrentThread();
+    LOG_I("vm worker %u start, tid: %d", idx, gettid());
+    VmTask task;
+    while (true) {
+        if (this->takeTask(idx, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->idleLock);
+        this->idle.wait(lock, [this]() {
+            return this->isStopping || this->pendingTasks != 0;
+        });
+        if (this->isStopping && this->pendingTasks == 0) {
+            break;
+        }
+    }
+    LOG_I("vm worker %u exit.", idx);
+}
@@ -0,0 +1,68 @@
+//
+// Created by 陈泽伦 on 1/16/21.
+//
+
+#ifndef VM_VMWORKERPOOL_H
+#define VM_VMWORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> VmTask;
+
+/**
+ * threads attached to the java vm, running the calls of Vm::callMethodAsync.
+ * Every worker has its own deque: it runs its newest task first, an idle
+ * worker steals the oldest task of another one.
+ */
+class VmWorkerPool {
+private:
+    struct Worker {
+        // never held while a task runs.
+        std::mutex lock;
+        std::deque<VmTask> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    const uint32_t maxQueueDepth;
+    // tasks submitted and not taken yet, at most maxQueueDepth.
+    std::atomic<uint32_t> queueDepth{0};
+    std::atomic<uint32_t> nextWorker{0};
+
+    // idle workers sleep on it.
+    std::mutex idleLock;
+    std::condition_variable idle;
+    // tasks in the deques, changed before idle is notified.
+    std::atomic<uint32_t> pendingTasks{0};
+    bool isStopping = false;
+
+    // the index of the worker running on this thread, -1 for the others.
+    static thread_local int curWorker;
+
+public:
+    VmWorkerPool(uint32_t threadCount, uint32_t maxQueueDepth);
+
+    // runs the tasks left, then joins the workers.
+    ~VmWorkerPool();
+
+    /**
+     * queue a task, on the own deque of a worker calling it.
+     * @return false if maxQueueDepth tasks are waiting already.
+     */
+    bool submit(VmTask task);
+
+private:
+    void runWorker(uint32_t idx);
+
+    bool takeTask(uint32_t idx, VmTask &task);
+};
+
+
+#endif //VM_VMWORKERPOOL_H
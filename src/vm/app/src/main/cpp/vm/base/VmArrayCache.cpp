@@ -0,0 +1,289 @@
+//
+// Created by 陈泽伦 on 1/10/21.
+//
+
+#include "VmArrayCache.h"
+#include "../../common/Util.h"
+#include "../../VmContext.h"
+#include <cstring>
+
+u1 *VmArrayCache::element(jarray array, char type, u4 index, bool isWrite, u4 &length) {
+    VmArrayWindow *window = this->find(array, type);
+    length = window->length;
+    if (index >= length) {
+        return nullptr;
+    }
+    if (index < window->start || window->start + window->count <= index) {
+        this->move(window, index);
+    }
+    const u4 off = index - window->start;
+    if (isWrite) {
+        window->dirty[off >> 6u] |= 1ULL << (off & 63u);
+        window->isDirty = true;
+    }
+    return window->data + (off << window->shift);
+}
+
+bool VmArrayCache::findLength(jarray array, u4 &length) const {
+    for (const auto &window : this->windows) {
+        if (window.array == array) {
+            length = window.length;
+            return true;
+        }
+    }
+    return false;
+}
+
+void VmArrayCache::flush() {
+    for (auto &window : this->windows) {
+        VmArrayCache::release(&window);
+    }
+}
+
+void VmArrayCache::flush(jarray array, bool checkAlias) {
+    for (auto &window : this->windows) {
+        if (window.array == array) {
+            VmArrayCache::release(&window);
+            return;
+        }
+    }
+    VmArrayWindow *window = checkAlias ? this->findAlias(array, 0xff) : nullptr;
+    if (window != nullptr) {
+        VmArrayCache::release(window);
+    }
+}
+
+void VmArrayCache::leaveFrame() {
+    this->releaseFrame();
+    assert(this->depth > 0);
+    this->depth--;
+}
+
+void VmArrayCache::releaseFrame() {
+    for (auto &window : this->windows) {
+        if (window.array != nullptr && window.depth >= this->depth) {
+            VmArrayCache::release(&window);
+        }
+    }
+}
+
+VmArrayWindow *VmArrayCache::find(jarray array, char type) {
+    for (auto &window : this->windows) {
+        if (window.array == array) {
+            return &window;
+        }
+    }
+
+    JNIEnv *env = VM_CONTEXT::env;
+    const u1 shift = type == 'J' ? 3 : type == 'I' ? 2 : type == 'C' || type == 'S' ? 1 : 0;
+    // another handle of a cached array, such as a field read again every loop.
+    VmArrayWindow *alias = this->findAlias(array, shift);
+    if (alias != nullptr) {
+        alias->array = array;
+        alias->depth = this->depth;
+        return alias;
+    }
+
+    VmArrayWindow *window = nullptr;
+    for (auto &it : this->windows) {
+        if (it.array == nullptr) {
+            window = &it;
+            break;
+        }
+    }
+    if (window == nullptr) {
+        window = &this->windows[this->victim];
+        this->victim = (this->victim + 1) % VM_CONFIG::VM_ARRAY_CACHE_SIZE;
+        VmArrayCache::release(window);
+    }
+
+    window->array = array;
+    window->shift = shift;
+    window->depth = this->depth;
+    window->hasIdentity = false;
+    // the length of an array never changes.
+    window->length = (*env).GetArrayLength(array);
+    window->start = 0;
+    window->count = 0;
+    window->isDirty = false;
+    memset(window->dirty, 0, sizeof(window->dirty));
+    // aget and aput are shared by int and float, long and double.
+    if (type == 'I' || type == 'J') {
+        const char otherType = type == 'I' ? 'F' : 'D';
+        window->type = (*env).IsInstanceOf(
+                array, VM_CONTEXT::vm->findPrimitiveArrayClass(otherType)) ? otherType : type;
+    } else {
+        window->type = type;
+    }
+    LOG_D_VM("cache array: %p, type: %c, length: %u", array, window->type, window->length);
+    return window;
+}
+
+VmArrayWindow *VmArrayCache::findAlias(jarray array, u1 shift) {
+    bool isUsed = false;
+    for (const auto &window : this->windows) {
+        isUsed = isUsed || (window.array != nullptr && (shift == 0xff || window.shift == shift));
+    }
+    if (!isUsed) {
+        return nullptr;
+    }
+    JNIEnv *env = VM_CONTEXT::env;
+    const jint identity = VmArrayCache::identityOf(array);
+    for (auto &window : this->windows) {
+        if (window.array == nullptr || (shift != 0xff && window.shift != shift)) {
+            continue;
+        }
+        // once per window, its handles may change but the object doesn't.
+        if (!window.hasIdentity) {
+            window.identity = VmArrayCache::identityOf(window.array);
+            window.hasIdentity = true;
+        }
+        if (window.identity == identity && (*env).IsSameObject(window.array, array)) {
+            return &window;
+        }
+    }
+    return nullptr;
+}
+
+jint VmArrayCache::identityOf(jobject obj) {
+    JNIEnv *env = VM_CONTEXT::env;
+    static const jclass cSystem = [env]() {
+        jclass clazz = (*env).FindClass(VM_REFLECT::C_NAME_System);
+        auto ret = (jclass) (*env).NewGlobalRef(clazz);
+        (*env).DeleteLocalRef(clazz);
+        return ret;
+    }();
+    static const jmethodID mIdentityHashCode = (*env).GetStaticMethodID(
+            cSystem,
+            VM_REFLECT::NAME_System_identityHashCode,
+            VM_REFLECT::SIGN_System_identityHashCode);
+    return (*env).CallStaticIntMethod(cSystem, mIdentityHashCode, obj);
+}
+
+void VmArrayCache::move(VmArrayWindow *window, u4 index) {
+    VmArrayCache::writeBack(window);
+    const u4 capacity = VM_CONFIG::VM_ARRAY_WINDOW_SIZE >> window->shift;
+    window->start = index & ~(capacity - 1);
+    window->count = MIN(capacity, window->length - window->start);
+
+    JNIEnv *env = VM_CONTEXT::env;
+    const jsize start = window->start;
+    const jsize count = window->count;
+    switch (window->type) {
+        case 'Z':
+            (*env).GetBooleanArrayRegion(
+                    (jbooleanArray) window->array, start, count, (jboolean *) window->data);
+            break;
+        case 'B':
+            (*env).GetByteArrayRegion(
+                    (jbyteArray) window->array, start, count, (jbyte *) window->data);
+            break;
+        case 'C':
+            (*env).GetCharArrayRegion(
+                    (jcharArray) window->array, start, count, (jchar *) window->data);
+            break;
+        case 'S':
+            (*env).GetShortArrayRegion(
+                    (jshortArray) window->array, start, count, (jshort *) window->data);
+            break;
+        case 'I':
+            (*env).GetIntArrayRegion(
+                    (jintArray) window->array, start, count, (jint *) window->data);
+            break;
+        case 'F':
+            (*env).GetFloatArrayRegion(
+                    (jfloatArray) window->array, start, count, (jfloat *) window->data);
+            break;
+        case 'J':
+            (*env).GetLongArrayRegion(
+                    (jlongArray) window->array, start, count, (jlong *) window->data);
+            break;
+        case 'D':
+            (*env).GetDoubleArrayRegion(
+                    (jdoubleArray) window->array, start, count, (jdouble *) window->data);
+            break;
+        default:
+            LOG_E("Unknown primitive type '%c'", window->type);
+            throw VMException(std::string("Unknown primitive type: ") + window->type);
+    }
+}
+
+// the first index in [from, end) whose dirty bit is isSet, end if none.
+static u4 findDirty(const uint64_t *dirty, u4 from, u4 end, bool isSet) {
+    while (from < end) {
+        uint64_t word = isSet ? dirty[from >> 6u] : ~dirty[from >> 6u];
+        word &= ~0ULL << (from & 63u);
+        if (word != 0) {
+            return MIN(end, (from & ~63u) + (u4) __builtin_ctzll(word));
+        }
+        from = (from & ~63u) + 64u;
+    }
+    return end;
+}
+
+void VmArrayCache::writeBack(VmArrayWindow *window) {
+    if (!window->isDirty) {
+        return;
+    }
+    const u4 count = window->count;
+    u4 begin = findDirty(window->dirty, 0, count, true);
+    while (begin < count) {
+        const u4 end = findDirty(window->dirty, begin, count, false);
+        VmArrayCache::writeRun(window, begin, end - begin);
+        begin = findDirty(window->dirty, end, count, true);
+    }
+    memset(window->dirty, 0, sizeof(window->dirty));
+    window->isDirty = false;
+}
+
+void VmArrayCache::writeRun(VmArrayWindow *window, u4 off, u4 count) {
+    JNIEnv *env = VM_CONTEXT::env;
+    const jsize start = window->start + off;
+    const u1 *data = window->data + (off << window->shift);
+    LOG_D_VM("write back array: %p, [%d, %d)", window->array, start, start + count);
+    switch (window->type) {
+        case 'Z':
+            (*env).SetBooleanArrayRegion(
+                    (jbooleanArray) window->array, start, count, (const jboolean *) data);
+            break;
+        case 'B':
+            (*env).SetByteArrayRegion(
+                    (jbyteArray) window->array, start, count, (const jbyte *) data);
+            break;
+        case 'C':
+            (*env).SetCharArrayRegion(
+                    (jcharArray) window->array, start, count, (const jchar *) data);
+            break;
+        case 'S':
+            (*env).SetShortArrayRegion(
+                    (jshortArray) window->array, start, count, (const jshort *) data);
+            break;
+        case 'I':
+            (*env).SetIntArrayRegion(
+                    (jintArray) window->array, start, count, (const jint *) data);
+            break;
+        case 'F':
+            (*env).SetFloatArrayRegion(
+                    (jfloatArray) window->array, start, count, (const jfloat *) data);
+            break;
+        case 'J':
+            (*env).SetLongArrayRegion(
+                    (jlongArray) window->array, start, count, (const jlong *) data);
+            break;
+        case 'D':
+            (*env).SetDoubleArrayRegion(
+                    (jdoubleArray) window->array, start, count, (const jdouble *) data);
+            break;
+        default:
+            LOG_E("Unknown primitive type '%c'", window->type);
+            throw VMException(std::string("Unknown primitive type: ") + window->type);
+    }
+}
+
+void VmArrayCache::release(VmArrayWindow *window) {
+    if (window->array == nullptr) {
+        return;
+    }
+    VmArrayCache::writeBack(window);
+    window->array = nullptr;
+}
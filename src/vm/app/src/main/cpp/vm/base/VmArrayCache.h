@@ -0,0 +1,94 @@
+//
+// Created by 陈泽伦 on 1/10/21.
+//
+
+#ifndef VM_VMARRAYCACHE_H
+#define VM_VMARRAYCACHE_H
+
+#include <jni.h>
+#include "../../common/AndroidSystem.h"
+#include "../../common/VmConstant.h"
+
+struct VmArrayWindow {
+    // nullptr if unused.
+    jarray array;
+    // 'Z', 'B', 'C', 'S', 'I', 'F', 'J' or 'D'.
+    char type;
+    // log2 of the element size.
+    u1 shift;
+    // vm frame depth of the array's handle.
+    u4 depth;
+    u4 length;
+
+    // System.identityHashCode of the array, found on the first alias lookup.
+    jint identity;
+    bool hasIdentity;
+
+    // region-copied elements [start, start + count).
+    u4 start;
+    u4 count;
+    // one bit per element stored by aput, relative to start. Only those are
+    // written back, the others may have been changed by another thread.
+    bool isDirty;
+    uint64_t dirty[VM_CONFIG::VM_ARRAY_WINDOW_SIZE / 64u];
+    alignas(8) u1 data[VM_CONFIG::VM_ARRAY_WINDOW_SIZE];
+};
+
+/**
+ * region-copied views of primitive arrays accessed by aget / aput.
+ * written back whenever java code or jni may observe the arrays.
+ */
+class VmArrayCache {
+private:
+    VmArrayWindow windows[VM_CONFIG::VM_ARRAY_CACHE_SIZE]{};
+    u4 victim = 0;
+    u4 depth = 0;
+
+public:
+    /**
+     * @param type: 'I' for int or float, 'J' for long or double.
+     * @return nullptr if index is out of bounds.
+     */
+    u1 *element(jarray array, char type, u4 index, bool isWrite, u4 &length);
+
+    bool findLength(jarray array, u4 &length) const;
+
+    // write back and drop every window.
+    void flush();
+
+    // write back and drop the array's window, if cached.
+    void flush(jarray array, bool checkAlias);
+
+    inline void enterFrame() {
+        this->depth++;
+    }
+
+    // the handles of the current frame are going away.
+    void leaveFrame();
+
+    void releaseFrame();
+
+private:
+    VmArrayWindow *find(jarray array, char type);
+
+    /**
+     * the window of another handle of array, compared by identity hash, so a
+     * new handle costs one jni call and an IsSameObject on a match.
+     * @param shift: of the element size, 0xff for any.
+     */
+    VmArrayWindow *findAlias(jarray array, u1 shift);
+
+    void move(VmArrayWindow *window, u4 index);
+
+    static void writeBack(VmArrayWindow *window);
+
+    // elements [off, off + count) of the window, off relative to its start.
+    static void writeRun(VmArrayWindow *window, u4 off, u4 count);
+
+    static jint identityOf(jobject obj);
+
+    static void release(VmArrayWindow *window);
+};
+
+
+#endif //VM_VMARRAYCACHE_H
@@ -6,64 +6,132 @@
 #include "../common/Util.h"
 #include <cstdlib>
 
-uint8_t *VmLinearCache::mallocCache(uint32_t key, uint32_t count) {
-    LOG_D_VM("key: %u, count: %u", key, count);
-    assert(key != 0);
-    auto *buf = this->cache.find(key)->second;
-    assert(0 < count && count <= 0xfff / buf->size);
-    uint8_t *memory;
-    if (count > this->full(buf)) {
+// the elements start 8 bytes aligned.
+static const uint32_t kPageHeaderSize = (sizeof(VmCachePage) + 7u) & ~7u;
+
+uint8_t *VmLinearCache::mallocCache(VmCacheType *type, uint32_t count) {
+    LOG_D_VM("type: %p, count: %u", type, count);
+    assert(type != nullptr);
+    assert(0 < count);
+    VmCachePage *page = type->page;
+    const uint32_t bytes = count * type->size;
+    if (page->top + bytes > page->pageCount << 12u) {
         // not enough
-        memory = this->memoryManager->malloc();
-        buf->bufList.push_back(memory);
-        buf->lastCount.push_back(count);
-        return memory;
-    } else {
-        uint32_t oldCount = buf->lastCount.back();
-        buf->lastCount.pop_back();
-        memory = buf->bufList.back() + oldCount * buf->size;
-        buf->lastCount.push_back(oldCount + count);
+        page = this->newPage(type, page, bytes);
+        type->page = page;
+    }
+    uint8_t *memory = (uint8_t *) page + page->top;
+    page->top += bytes;
+    type->bytes += bytes;
+    if (type->bytes > type->maxBytes) {
+        type->maxBytes = type->bytes;
     }
     LOG_D_VM("malloc new cache: %p", memory);
     return memory;
 }
 
-void VmLinearCache::freeCache(uint32_t key, uint32_t count) {
-    LOG_D_VM("key: %u, count: %u", key, count);
-    assert(key != 0);
-    auto *buf = this->cache.find(key)->second;
-    uint32_t oldCount = buf->lastCount.back();
-    buf->lastCount.pop_back();
-    assert(count <= oldCount);
-    if (count == oldCount) {
-        if (buf->bufList.size() == 1) {
-            buf->lastCount.push_back(0u);
+void VmLinearCache::freeCache(VmCacheType *type, uint32_t count) {
+    LOG_D_VM("type: %p, count: %u", type, count);
+    assert(type != nullptr);
+    VmCachePage *page = type->page;
+    const uint32_t bytes = count * type->size;
+    assert(page->top >= kPageHeaderSize + bytes);
+    page->top -= bytes;
+    type->bytes -= bytes;
+    if (page->top == kPageHeaderSize && page->pre != nullptr) {
+        type->page = page->pre;
+        if (page->pageCount == 1) {
+            if (type->spare != nullptr) {
+                this->memoryManager->free(type->spare);
+            }
+            type->spare = page;
         } else {
-            this->memoryManager->free(buf->bufList.back());
-            buf->bufList.pop_back();
+            this->deletePage(page);
         }
-    } else {
-        buf->lastCount.push_back(oldCount - count);
     }
 }
 
-uint32_t VmLinearCache::newCacheType(uint32_t bufSize) {
+VmCacheType *VmLinearCache::newCacheType(uint32_t bufSize) {
     LOG_D_VM("bufSize: %u", bufSize);
-    uint32_t key;
-    do {
-        key = random();
-        LOG_D_VM("trying cache type: %u", key);
-    } while (this->cache.find(key) != this->cache.end() || key == 0);
-    auto *buf = new VmLinearCacheBuffer();
-    buf->size = bufSize;
-    buf->bufList.push_back(this->memoryManager->malloc());
-    buf->lastCount.push_back(0u);
-    this->cache[key] = buf;
-    LOG_D_VM("create new cache type: %u", key);
-    return key;
+    assert(0 < bufSize && bufSize <= 0x1000u - kPageHeaderSize);
+    auto *type = new VmCacheType();
+    type->size = bufSize;
+    type->capacity = (0x1000u - kPageHeaderSize) / bufSize;
+    type->spare = nullptr;
+    type->bytes = 0;
+    type->maxBytes = 0;
+    type->page = this->newPage(type, nullptr, bufSize);
+    this->types.push_back(type);
+    LOG_D_VM("create new cache type: %p", type);
+    return type;
+}
+
+std::vector<VmCacheTypeStats> VmLinearCache::getCacheStats() const {
+    std::vector<VmCacheTypeStats> stats;
+    for (const auto type : this->types) {
+        VmCacheTypeStats it{type->size, type->bytes, type->maxBytes, 0};
+        for (VmCachePage *page = type->page; page != nullptr; page = page->pre) {
+            it.pages += page->pageCount;
+        }
+        if (type->spare != nullptr) {
+            it.pages++;
+        }
+        stats.push_back(it);
+    }
+    return stats;
+}
+
+void VmLinearCache::trimCache() {
+    for (auto type : this->types) {
+        if (type->spare != nullptr) {
+            this->memoryManager->free(type->spare);
+            type->spare = nullptr;
+        }
+    }
+}
+
+VmCachePage *VmLinearCache::newPage(VmCacheType *type, VmCachePage *pre, uint32_t bytes) {
+    VmCachePage *page;
+    uint32_t pageCount = 1;
+    if (kPageHeaderSize + bytes > 0x1000u) {
+        pageCount = (kPageHeaderSize + bytes + 0xfffu) >> 12u;
+        page = (VmCachePage *) this->memoryManager->mallocSpan(pageCount);
+        LOG_D_VM("malloc a span of %u pages: %p", pageCount, page);
+    } else if (type->spare != nullptr) {
+        page = type->spare;
+        type->spare = nullptr;
+    } else {
+        page = (VmCachePage *) this->memoryManager->malloc();
+    }
+    page->pre = pre;
+    page->top = kPageHeaderSize;
+    page->pageCount = pageCount;
+    return page;
+}
+
+void VmLinearCache::deletePage(VmCachePage *page) {
+    if (page->pageCount == 1) {
+        this->memoryManager->free(page);
+    } else {
+        this->memoryManager->freeSpan(page, page->pageCount);
+    }
 }
 
 VmLinearCache::VmLinearCache(VmMemory *memoryManager) {
     this->memoryManager = memoryManager;
     assert(this->memoryManager != nullptr);
 }
+
+VmLinearCache::~VmLinearCache() {
+    for (auto type : this->types) {
+        for (VmCachePage *page = type->page; page != nullptr;) {
+            VmCachePage *pre = page->pre;
+            this->deletePage(page);
+            page = pre;
+        }
+        if (type->spare != nullptr) {
+            this->memoryManager->free(type->spare);
+        }
+        delete type;
+    }
+}
@@ -8,44 +8,86 @@
 #include "stdint.h"
 #include "VmMemory.h"
 
-#include <map>
-#include <list>
+#include <vector>
+
+/**
+ * header of a cache page, the elements are bumped behind it.
+ */
+struct VmCachePage {
+    // the page filled before this one.
+    VmCachePage *pre;
+    // bytes used, header included.
+    uint32_t top;
+    // pages of the span, more than one for a buffer bigger than a page.
+    uint32_t pageCount;
+};
+
+/**
+ * handle of a cache type, returned by newCacheType.
+ * the buffers of a type are malloc'd and freed in stack order.
+ */
+struct VmCacheType {
+    // bytes of one element.
+    uint32_t size;
+    // elements fit in one page, bigger buffers get a span of their own.
+    uint32_t capacity;
+    VmCachePage *page;
+    // an empty page kept, so a call crossing a page boundary needs no new page.
+    VmCachePage *spare;
+    // bytes malloc'd now, and the most of them at once.
+    uint64_t bytes;
+    uint64_t maxBytes;
+};
+
+struct VmCacheTypeStats {
+    uint32_t size;
+    uint64_t bytes;
+    uint64_t maxBytes;
+    // pages held by the type, the spare one included.
+    uint32_t pages;
+};
 
 class VmCache {
 public:
-    virtual uint8_t *mallocCache(uint32_t key, uint32_t count) = 0;
+    virtual uint8_t *mallocCache(VmCacheType *type, uint32_t count) = 0;
 
-    virtual void freeCache(uint32_t key, uint32_t count) = 0;
+    virtual void freeCache(VmCacheType *type, uint32_t count) = 0;
 
-    virtual uint32_t newCacheType(uint32_t bufSize) = 0;
+    virtual VmCacheType *newCacheType(uint32_t bufSize) = 0;
 
-    virtual ~VmCache(){};
-};
+    // one entry per cache type, in the order they were made.
+    virtual std::vector<VmCacheTypeStats> getCacheStats() const = 0;
 
-struct VmLinearCacheBuffer {
-    uint32_t size;
-    std::list<uint8_t *> bufList;
-    std::list<uint32_t> lastCount;
+    // give back the spare pages of every type.
+    virtual void trimCache() = 0;
+
+    virtual ~VmCache(){};
 };
 
 class VmLinearCache : public VmCache {
 private:
     VmMemory *memoryManager;
-    std::map<uint32_t, VmLinearCacheBuffer *> cache;
+    std::vector<VmCacheType *> types;
 
 public:
     VmLinearCache(VmMemory *memoryManager);
 
-    uint8_t *mallocCache(uint32_t key, uint32_t count) override;
+    ~VmLinearCache();
 
-    void freeCache(uint32_t key, uint32_t count) override;
+    uint8_t *mallocCache(VmCacheType *type, uint32_t count) override;
 
-    uint32_t newCacheType(uint32_t bufSize) override;
+    void freeCache(VmCacheType *type, uint32_t count) override;
+
+    VmCacheType *newCacheType(uint32_t bufSize) override;
+
+    std::vector<VmCacheTypeStats> getCacheStats() const override;
+
+    void trimCache() override;
 
 private:
-    inline uint32_t full(VmLinearCacheBuffer *buf) const {
-        return 0xfff / buf->size - buf->lastCount.back();
-    }
+    VmCachePage *newPage(VmCacheType *type, VmCachePage *pre, uint32_t bytes);
+
+    void deletePage(VmCachePage *page);
 };
 
 #endif //VM_VMCACHE_H
@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 #include <jni.h>
 
 
@@ -19,6 +20,13 @@
 #endif
 
 
+// how much memory the vm gives back, see Vm::trimMemory.
+enum class VmTrimLevel : uint32_t {
+    Light = 0,
+    Moderate = 1,
+    Critical = 2,
+};
+
 union RegValue {
     jboolean z;
     jbyte b;
@@ -57,6 +65,30 @@ union RegValue {
 struct VmTempData {
     uint16_t src1 = 0, src2 = 0, dst = 0;
     RegValue val_1{}, val_2{};
+
+    // backward branches since the last local references reclamation.
+    uint32_t backEdges = 0;
+    // the outermost call runs with a VmCallBudget, see Vm::chargeBudget.
+    bool hasBudget = false;
+    // bumped whenever the handles of local refs may be reused.
+    uint32_t refEpoch = 0;
+    // bumped whenever unknown java code may run.
+    uint32_t epoch = 0;
+
+    // new-instance deferred to its invoke-direct <init>, see VmFusion.
+    const uint16_t *pendingInit = nullptr;
+    uint16_t pendingReg = 0;
+    jclass pendingClass = nullptr;
+
+    // object registers hold an index into refs, 0 is null. Every frame owns
+    // the entries from its refBase on, see VmMethodContext::setRegisterAsObject.
+    std::vector<jobject> refs{nullptr};
+
+    // the last new-array, valid in the same refEpoch, see ST_CH_Fill_Array_Data.
+    jarray lastNewArray = nullptr;
+    char lastNewArrayType = 0;
+    uint32_t lastNewArrayLength = 0;
+    uint32_t lastNewArrayEpoch = 0;
 };
 
 
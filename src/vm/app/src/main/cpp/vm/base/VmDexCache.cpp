@@ -0,0 +1,17 @@
+//
+// Created by 陈泽伦 on 1/14/21.
+//
+
+#include "VmDexCache.h"
+
+VmDexCache::VmDexCache(const u1 *begin) :
+        dexFile(begin),
+        strings(dexFile.pHeader->stringIdsSize),
+        classes(dexFile.pHeader->typeIdsSize),
+        elementClasses(dexFile.pHeader->typeIdsSize),
+        methods(dexFile.pHeader->methodIdsSize),
+        fields(dexFile.pHeader->fieldIdsSize) {
+    LOG_I("new dex cache: %p, strings: %u, types: %u, methods: %u, fields: %u",
+          begin, this->strings.size(), this->classes.size(),
+          this->methods.size(), this->fields.size());
+}
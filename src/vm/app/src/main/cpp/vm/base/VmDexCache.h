@@ -0,0 +1,163 @@
+//
+// Created by 陈泽伦 on 1/14/21.
+//
+
+#ifndef VM_VMDEXCACHE_H
+#define VM_VMDEXCACHE_H
+
+#include <atomic>
+#include <cstdlib>
+#include "VmMethod.h"
+
+/**
+ * one slot per dex id, shared by the threads running the vm. A reader takes
+ * no lock: a slot is either empty, claimed or holds the resolved value, and
+ * a writer publishes with compare-and-swap, so the first value wins.
+ */
+template<typename T>
+class VmSlotArray {
+private:
+    static_assert(std::atomic<T>::is_always_lock_free, "slots must be lock free.");
+    static_assert(sizeof(std::atomic<T>) == sizeof(T), "slots must be plain words.");
+
+    // calloc, the pages of the ids never resolved are never touched.
+    std::atomic<T> *slots;
+    // resolves since the last trim, saturated at VM_RESOLVE_CACHE_HOT_HITS.
+    std::atomic<u1> *hits;
+    u4 count;
+
+public:
+    explicit VmSlotArray(u4 count) : count(count) {
+        this->slots = (std::atomic<T> *) calloc(count == 0 ? 1 : count, sizeof(std::atomic<T>));
+        this->hits = (std::atomic<u1> *) calloc(count == 0 ? 1 : count, sizeof(std::atomic<u1>));
+        if (this->slots == nullptr || this->hits == nullptr) {
+            throw VMException("can't alloc the resolve slots.");
+        }
+    }
+
+    VmSlotArray(const VmSlotArray &) = delete;
+
+    VmSlotArray &operator=(const VmSlotArray &) = delete;
+
+    ~VmSlotArray() {
+        ::free(this->slots);
+        ::free(this->hits);
+    }
+
+    // the slot of a thread still making its global ref.
+    static inline T claimed() {
+        return reinterpret_cast<T>(1);
+    }
+
+    inline u4 size() const {
+        return this->count;
+    }
+
+    // nullptr if not resolved yet.
+    inline T find(u4 idx) const {
+        assert(idx < this->count);
+        T ret = this->slots[idx].load(std::memory_order_acquire);
+        if (ret == nullptr || ret == VmSlotArray::claimed()) {
+            return nullptr;
+        }
+        // a plain store, a hot slot is only read by every thread.
+        u1 hit = this->hits[idx].load(std::memory_order_relaxed);
+        if (hit < VM_CONFIG::VM_RESOLVE_CACHE_HOT_HITS) {
+            this->hits[idx].store(hit + 1, std::memory_order_relaxed);
+        }
+        return ret;
+    }
+
+    /**
+     * for values which own nothing, such as jmethodID.
+     * @return the value of the slot, val or the one published before it.
+     */
+    inline T publish(u4 idx, T val) {
+        assert(idx < this->count);
+        T expected = nullptr;
+        if (this->slots[idx].compare_exchange_strong(
+                expected, val, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return val;
+        }
+        return expected;
+    }
+
+    /**
+     * for values which own a global ref: only the thread claiming the empty
+     * slot makes it, then it calls publishClaimed.
+     */
+    inline bool claim(u4 idx) {
+        assert(idx < this->count);
+        T expected = nullptr;
+        return this->slots[idx].compare_exchange_strong(
+                expected, VmSlotArray::claimed(),
+                std::memory_order_acq_rel, std::memory_order_relaxed);
+    }
+
+    // val is nullptr if the claimed slot couldn't be resolved.
+    inline void publishClaimed(u4 idx, T val) {
+        assert(this->slots[idx].load(std::memory_order_relaxed) == VmSlotArray::claimed());
+        this->slots[idx].store(val, std::memory_order_release);
+    }
+
+    /**
+     * empties the slots resolved fewer than minHits times and calls drop
+     * with their values, keep with the others. Only while no thread runs
+     * the vm, nothing else is synchronized with it.
+     */
+    template<typename Drop, typename Keep>
+    void trim(uint32_t minHits, Drop drop, Keep keep) {
+        for (u4 i = 0; i < this->count; i++) {
+            T val = this->slots[i].load(std::memory_order_relaxed);
+            if (val == nullptr) {
+                continue;
+            }
+            assert(val != VmSlotArray::claimed());
+            if (this->hits[i].load(std::memory_order_relaxed) < minHits) {
+                this->slots[i].store(nullptr, std::memory_order_relaxed);
+                drop(val);
+            } else {
+                keep(val);
+            }
+            this->hits[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    template<typename Func>
+    void forEach(Func func) const {
+        for (u4 i = 0; i < this->count; i++) {
+            T val = this->slots[i].load(std::memory_order_acquire);
+            if (val != nullptr && val != VmSlotArray::claimed()) {
+                func(val);
+            }
+        }
+    }
+};
+
+struct VmStringEntry;
+
+/**
+ * the resolved ids of one dex file, shared by every VmMethod from it.
+ */
+class VmDexCache {
+public:
+    DexFile dexFile;
+
+    VmSlotArray<VmStringEntry *> strings;
+    VmSlotArray<jclass> classes;
+    // key: array type, value: its element class.
+    VmSlotArray<jclass> elementClasses;
+    VmSlotArray<jmethodID> methods;
+    VmSlotArray<jfieldID> fields;
+
+public:
+    explicit VmDexCache(const u1 *begin);
+
+    // the address the dex file was mapped at, as ART knows it.
+    inline const u1 *getBegin() const {
+        return (const u1 *) this->dexFile.pHeader;
+    }
+};
+
+
+#endif //VM_VMDEXCACHE_H
@@ -3,25 +3,217 @@
 //
 
 #include "VmMemory.h"
+#include "VmRandom.h"
 #include "../../common/Util.h"
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <cstdlib>
 #include <cerrno>
+#include <algorithm>
 
-VmRandomMemory::VmRandomMemory(uint64_t memSize) {
+VmPageBitmap::VmPageBitmap(uint32_t pageCount)
+        : pageCount(pageCount), usedCount(0),
+          words((pageCount + 63u) >> 6u, 0),
+          summary((((pageCount + 63u) >> 6u) + 63u) >> 6u, 0) {
+    assert(pageCount > 0);
+    // the tail bits past the last page are never free.
+    if (pageCount & 63u) {
+        this->words.back() = ~0ULL << (pageCount & 63u);
+    }
+    const uint32_t wordCount = this->words.size();
+    if (wordCount & 63u) {
+        this->summary.back() = ~0ULL << (wordCount & 63u);
+    }
+}
+
+uint32_t VmPageBitmap::findFree(uint32_t start) const {
+    assert(start < this->pageCount);
+    const uint32_t startWord = start >> 6u;
+    const uint32_t summaryCount = this->summary.size();
+    uint32_t s = startWord >> 6u;
+    uint64_t mask = ~0ULL << (startWord & 63u);
+    // at most one lap over the summary, the first word is visited twice
+    // to look at the bits before startWord.
+    for (uint32_t i = 0; i <= summaryCount; i++) {
+        this->probeCount++;
+        const uint64_t candidates = ~this->summary[s] & mask;
+        if (candidates != 0) {
+            const uint32_t w = (s << 6u) + __builtin_ctzll(candidates);
+            const uint32_t rot = start & 63u;
+            const uint64_t freeBits = ~this->words[w];
+            const uint64_t rotated = (freeBits >> rot) | (freeBits << ((64u - rot) & 63u));
+            return (w << 6u) + ((rot + __builtin_ctzll(rotated)) & 63u);
+        }
+        s = s + 1 == summaryCount ? 0 : s + 1;
+        mask = ~0ULL;
+    }
+    return kNoPage;
+}
+
+uint32_t VmPageBitmap::findFreeRun(uint32_t start, uint32_t count) const {
+    assert(start < this->pageCount && count > 0);
+    uint32_t ret = this->findFreeRun(start, this->pageCount, count);
+    if (ret == kNoPage) {
+        ret = this->findFreeRun(0, MIN(start + count - 1, this->pageCount), count);
+    }
+    return ret;
+}
+
+uint32_t VmPageBitmap::findFreeRun(uint32_t from, uint32_t to, uint32_t count) const {
+    // the tail bits past the last page are set, so a run never leaves the bitmap.
+    uint32_t runLength = 0;
+    for (uint32_t page = from; page < to;) {
+        this->probeCount++;
+        const uint64_t word = this->words[page >> 6u];
+        if ((page & 63u) == 0 && word == ~0ULL) {
+            runLength = 0;
+            page += 64u;
+        } else if ((page & 63u) == 0 && word == 0) {
+            runLength += 64u;
+            page += 64u;
+            if (runLength >= count) {
+                return page - runLength;
+            }
+        } else if (this->test(page)) {
+            runLength = 0;
+            page++;
+        } else {
+            page++;
+            if (++runLength == count) {
+                return page - count;
+            }
+        }
+    }
+    return kNoPage;
+}
+
+void VmPageBitmap::set(uint32_t page) {
+    assert(!this->test(page));
+    const uint32_t w = page >> 6u;
+    this->words[w] |= 1ULL << (page & 63u);
+    if (this->words[w] == ~0ULL) {
+        this->summary[w >> 6u] |= 1ULL << (w & 63u);
+    }
+    this->usedCount++;
+}
+
+void VmPageBitmap::clear(uint32_t page) {
+    assert(this->test(page));
+    const uint32_t w = page >> 6u;
+    this->words[w] &= ~(1ULL << (page & 63u));
+    this->summary[w >> 6u] &= ~(1ULL << (w & 63u));
+    this->usedCount--;
+}
+
+static const uint64_t kHugePageSize = 2UL << 20U;
+
+VmRandomMemory::VmRandomMemory(uint64_t memSize, const VmMemoryOptions &options)
+        : fullPages(memSize >> 12u) {
     assert((memSize & 0xfffu) == 0);
-    this->base = (uint8_t *) mmap(nullptr,
-                                  memSize,
-                                  (uint) PROT_READ | (uint) PROT_WRITE,
-                                  (uint) MAP_PRIVATE | (uint) MAP_ANONYMOUS,
-                                  -1, 0);
-    if (this->base == MAP_FAILED) {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    this->startMinorFaults = usage.ru_minflt;
+    this->startMajorFaults = usage.ru_majflt;
+
+    this->maxPageCount = memSize >> 12u;
+    this->growPageCount = options.growSize >> 12u;
+    if (this->growPageCount >= this->maxPageCount) {
+        this->growPageCount = 0;
+    }
+    // a lazy arena is only reserved, grow opens it chunk by chunk.
+    const uint32_t prot = this->growPageCount == 0
+                          ? (uint) PROT_READ | (uint) PROT_WRITE : (uint) PROT_NONE;
+    // huge pages need the arena aligned to them, the unaligned ends are unmapped.
+    const uint64_t align = options.hugePages ? kHugePageSize : 0x1000u;
+    const uint64_t reserveSize = memSize + align - 0x1000u;
+    auto *region = (uint8_t *) mmap(nullptr,
+                                    reserveSize,
+                                    prot,
+                                    (uint) MAP_PRIVATE | (uint) MAP_ANONYMOUS,
+                                    -1, 0);
+    if (region == MAP_FAILED) {
         LOG_E("VmRandomMemory mmap this->base fail.");
         LOG_E("error: %s", strerror(errno));
         throw VMException("VmRandomMemory mmap this->base fail.");
     }
-    this->maxPageCount = memSize >> 12u;
-    LOG_D_VM("memory size: %lu, base: %p", memSize, this->base);
+    this->base = (uint8_t *) (((uint64_t) region + align - 1u) & ~(align - 1u));
+    if (this->base != region) {
+        munmap(region, this->base - region);
+    }
+    if (this->base + memSize != region + reserveSize) {
+        munmap(this->base + memSize, region + reserveSize - (this->base + memSize));
+    }
+
+    if (options.hugePages) {
+#if defined(MADV_HUGEPAGE)
+        if (madvise(this->base, memSize, MADV_HUGEPAGE) == -1) {
+            LOG_W("VmRandomMemory no huge pages: %s", strerror(errno));
+        }
+#else
+        LOG_W("VmRandomMemory no huge pages on this platform.");
+#endif
+    }
+
+    if (this->growPageCount == 0) {
+        this->committedPages = this->maxPageCount;
+    } else {
+        // the pages not opened yet look used to the bitmap.
+        this->committedPages = 0;
+        for (uint32_t page = 0; page < this->maxPageCount; page++) {
+            this->fullPages.set(page);
+        }
+        this->grow();
+    }
+
+    const uint32_t prefaultCount = MIN(options.prefaultSize >> 12u, this->maxPageCount);
+    while (this->committedPages < prefaultCount && this->grow()) {
+    }
+    this->prefault(prefaultCount);
+
+    getrusage(RUSAGE_SELF, &usage);
+    this->initMinorFaults = usage.ru_minflt - this->startMinorFaults;
+    this->initMajorFaults = usage.ru_majflt - this->startMajorFaults;
+    LOG_I("VmRandomMemory base: %p, pages: %u, committed: %u, prefault: %u, huge page: %d, "
+          "init faults (minor/major): %llu/%llu",
+          this->base, this->maxPageCount, this->committedPages, prefaultCount,
+          options.hugePages, (unsigned long long) this->initMinorFaults,
+          (unsigned long long) this->initMajorFaults);
+}
+
+bool VmRandomMemory::grow() {
+    if (this->committedPages == this->maxPageCount) {
+        return false;
+    }
+    const uint32_t count = MIN(this->growPageCount, this->maxPageCount - this->committedPages);
+    if (mprotect(this->memNum2Mem(this->committedPages),
+                 (uint64_t) count << 12u,
+                 (uint) PROT_READ | (uint) PROT_WRITE) == -1) {
+        LOG_E("VmRandomMemory can't open %u pages at: %u", count, this->committedPages);
+        LOG_E("error: %s", strerror(errno));
+        throw VMException("VmRandomMemory can't grow.");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        this->fullPages.clear(this->committedPages + i);
+    }
+    this->committedPages += count;
+    LOG_D_VM("VmRandomMemory::grow, committed pages: %u", this->committedPages);
+    return true;
+}
+
+void VmRandomMemory::prefault(uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+#if defined(MADV_POPULATE_WRITE)
+    // linux 5.14, faults the pages in without touching them.
+    if (madvise(this->base, (uint64_t) count << 12u, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    // a write fault, a read one would only map the zero page.
+    for (uint32_t i = 0; i < count; i++) {
+        *(volatile uint8_t *) this->memNum2Mem(i) = 0;
+    }
 }
 
 VmRandomMemory::~VmRandomMemory() {
@@ -29,18 +221,30 @@ VmRandomMemory::~VmRandomMemory() {
 }
 
 uint8_t *VmRandomMemory::malloc() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->mallocPage();
+}
+
+uint8_t *VmRandomMemory::mallocPage() {
     uint32_t memNum;
     if (!this->freePages.empty()) {
         // mallocCache from cache.
-        memNum = *this->freePages.begin();
-        this->freePages.erase(memNum);
+        memNum = this->freePages.back();
+        this->freePages.pop_back();
+        this->freePageCount.store(this->freePages.size(), std::memory_order_relaxed);
     } else {
-        // choose a memory unused.
-        do {
-            memNum = random() % this->maxPageCount;
-        } while (this->fullPages.find(memNum) != this->fullPages.end());
+        // choose a memory unused, starting from a random place.
+        this->bitmapMallocs++;
+        memNum = this->fullPages.findFree(VmRandom::below(this->committedPages));
+        while (memNum == VmPageBitmap::kNoPage && this->grow()) {
+            memNum = this->fullPages.findFree(VmRandom::below(this->committedPages));
+        }
+        if (memNum == VmPageBitmap::kNoPage) {
+            LOG_E("VmRandomMemory is full, pages: %u", this->maxPageCount);
+            throw VMException("VmRandomMemory is full.");
+        }
+        this->fullPages.set(memNum);
     }
-    this->fullPages.insert(memNum);
     LOG_D_VM("VmRandomMemory::mallocCache: %p, num: %u", this->memNum2Mem(memNum), memNum);
     return this->memNum2Mem(memNum);
 }
@@ -48,44 +252,134 @@ uint8_t *VmRandomMemory::malloc() {
 void VmRandomMemory::free(void *p) {
     uint32_t memNum = this->mem2MemNum((uint8_t *) p);
     LOG_D_VM("VmRandomMemory::freeCache: %p, num: %u", p, memNum);
-    this->fullPages.erase(memNum);
-    this->freePages.insert(memNum);
-    this->freeToSystem();
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->freePages.push_back(memNum);
+    this->freePageCount.store(this->freePages.size(), std::memory_order_relaxed);
+}
+
+uint8_t *VmRandomMemory::mallocSpan(uint32_t count) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (count == 1) {
+        return this->mallocPage();
+    }
+    this->bitmapMallocs++;
+    uint32_t memNum = this->fullPages.findFreeRun(VmRandom::below(this->committedPages), count);
+    while (memNum == VmPageBitmap::kNoPage && this->grow()) {
+        memNum = this->fullPages.findFreeRun(VmRandom::below(this->committedPages), count);
+    }
+    if (memNum == VmPageBitmap::kNoPage) {
+        LOG_E("VmRandomMemory has no %u free pages in a row.", count);
+        throw VMException("VmRandomMemory is full.");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        this->fullPages.set(memNum + i);
+    }
+    LOG_D_VM("VmRandomMemory::mallocSpan: %p, num: %u, count: %u",
+             this->memNum2Mem(memNum), memNum, count);
+    return this->memNum2Mem(memNum);
+}
+
+void VmRandomMemory::freeSpan(void *p, uint32_t count) {
+    // the pages are reused one by one, trim coalesces them again.
+    const uint32_t memNum = this->mem2MemNum((uint8_t *) p);
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (uint32_t i = 0; i < count; i++) {
+        this->freePages.push_back(memNum + i);
+    }
+    this->freePageCount.store(this->freePages.size(), std::memory_order_relaxed);
+}
+
+void VmRandomMemory::trim() {
+    // called at the end of every outermost call, most of them find nothing to do.
+    if (this->freePageCount.load(std::memory_order_relaxed) <=
+        VM_CONFIG::VM_MEMORY_FREE_PAGE_HIGH) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->freePages.size() > VM_CONFIG::VM_MEMORY_FREE_PAGE_HIGH) {
+        this->releasePages(VM_CONFIG::VM_MEMORY_FREE_PAGE_LOW);
+    }
+}
+
+void VmRandomMemory::release(uint32_t keepPages) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->releasePages(keepPages);
 }
 
-void VmRandomMemory::freeToSystem() {
-    if (this->freePages.size() < VM_CONFIG::VM_MEMORY_FREE_PAGE_SIZE) {
+void VmRandomMemory::releasePages(uint32_t keepPages) {
+    if (this->freePages.size() <= keepPages) {
         return;
     }
-    LOG_D_VM("freeToSystem");
-    std::set<uint32_t> needDel;
-    uint32_t idx = 0;
-    for (auto it = this->freePages.begin(); it != this->freePages.end(); it++, idx++) {
-        if (idx & 0x01u) {
-            continue;
+    // the oldest free pages go back to the system and to the random pool.
+    const uint32_t count = this->freePages.size() - keepPages;
+    std::vector<uint32_t> pages(this->freePages.begin(), this->freePages.begin() + count);
+    this->freePages.erase(this->freePages.begin(), this->freePages.begin() + count);
+    this->freePageCount.store(this->freePages.size(), std::memory_order_relaxed);
+    std::sort(pages.begin(), pages.end());
+    this->reclaimedPages += count;
+    LOG_D_VM("VmRandomMemory::release: %u pages", count);
+
+    // one madvise for every run of adjacent pages.
+    uint32_t runStart = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        this->fullPages.clear(pages[i]);
+        if (i + 1 == count || pages[i + 1] != pages[i] + 1) {
+            this->freeToSystem(pages[runStart], i + 1 - runStart);
+            runStart = i + 1;
+        }
+    }
+}
+
+void VmRandomMemory::freeToSystem(uint32_t memNum, uint32_t count) {
+#if defined(MADV_FREE)
+    // MADV_FREE lets the kernel take the pages lazily, it needs linux 4.5.
+    static bool hasMadvFree = true;
+    if (hasMadvFree) {
+        if (madvise(this->memNum2Mem(memNum), count << 12u, MADV_FREE) == 0) {
+            LOG_D_VM("madvise free: %p, pages: %u", this->memNum2Mem(memNum), count);
+            return;
         }
-        needDel.insert(*it);
-        if (munmap(this->memNum2Mem(*it), 0x1000u) == -1) {
-            LOG_E("can't munmap at: %p", this->memNum2Mem(*it));
+        if (errno != EINVAL) {
+            LOG_E("can't madvise at: %p", this->memNum2Mem(memNum));
             LOG_E("error: %s", strerror(errno));
-            throw VMException("can't munmap.");
+            throw VMException("can't madvise.");
         }
-        LOG_D_VM("munmap: %p", this->memNum2Mem(*it));
+        hasMadvFree = false;
+    }
+#endif
+    if (madvise(this->memNum2Mem(memNum), count << 12u, MADV_DONTNEED) == -1) {
+        LOG_E("can't madvise at: %p", this->memNum2Mem(memNum));
+        LOG_E("error: %s", strerror(errno));
+        throw VMException("can't madvise.");
     }
+    LOG_D_VM("madvise dontneed: %p, pages: %u", this->memNum2Mem(memNum), count);
+}
 
-    for (auto it : needDel) {
-        this->fullPages.erase(it);
-        if (mmap(this->memNum2Mem(it),
-                 0x1000u,
-                 (uint) PROT_WRITE | (uint) PROT_READ,
-                 (uint) MAP_ANONYMOUS | (uint) MAP_FIXED,
-                 -1, 0) == MAP_FAILED) {
-            LOG_E("can't mmap at: %p", this->memNum2Mem(it));
-            LOG_E("error: %s", strerror(errno));
-            throw VMException("can't mmap.");
+VmMemoryStats VmRandomMemory::getStats() const {
+    std::lock_guard<std::mutex> guard(this->lock);
+    VmMemoryStats stats{};
+    stats.committedPages = this->committedPages;
+    // the pages not opened yet are set in the bitmap too.
+    stats.cachedPages = this->freePages.size();
+    stats.usedPages = this->fullPages.used() - (this->maxPageCount - this->committedPages)
+                      - stats.cachedPages;
+    stats.reclaimedPages = this->reclaimedPages;
+    stats.bitmapMallocs = this->bitmapMallocs;
+    stats.probes = this->fullPages.probes();
+    std::vector<unsigned char> resident(this->committedPages);
+    if (this->committedPages != 0 &&
+        mincore(this->base, (uint64_t) this->committedPages << 12u, resident.data()) == 0) {
+        for (unsigned char it : resident) {
+            stats.residentPages += it & 1u;
         }
-        LOG_D_VM("mmap: %p", this->memNum2Mem(it));
     }
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    stats.initMinorFaults = this->initMinorFaults;
+    stats.initMajorFaults = this->initMajorFaults;
+    stats.minorFaults = usage.ru_minflt - this->startMinorFaults;
+    stats.majorFaults = usage.ru_majflt - this->startMajorFaults;
+    return stats;
 }
 
 uint8_t *VmRandomMemory::memNum2Mem(uint32_t memNum) const {
@@ -8,7 +8,84 @@
 #include "VmCommon.h"
 #include "../../common/VmConstant.h"
 
-#include <set>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/**
+ * two level bitmap of pages, a set bit means the page is used.
+ * every word of the summary level marks 64 full words below it.
+ */
+class VmPageBitmap {
+public:
+    static const uint32_t kNoPage = UINT32_MAX;
+
+private:
+    uint32_t pageCount;
+    uint32_t usedCount;
+    // words looked at by findFree and findFreeRun.
+    mutable uint64_t probeCount = 0;
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> summary;
+
+public:
+    explicit VmPageBitmap(uint32_t pageCount);
+
+    // a free page in the first non full word at or after the word of start,
+    // looked up from the bit of start onwards. kNoPage if all pages are used.
+    uint32_t findFree(uint32_t start) const;
+
+    // the first run of count free pages at or after start, wrapping around.
+    uint32_t findFreeRun(uint32_t start, uint32_t count) const;
+
+    void set(uint32_t page);
+
+    void clear(uint32_t page);
+
+    inline bool test(uint32_t page) const {
+        return (this->words[page >> 6u] >> (page & 63u)) & 1u;
+    }
+
+    inline uint32_t used() const {
+        return this->usedCount;
+    }
+
+    inline uint64_t probes() const {
+        return this->probeCount;
+    }
+
+private:
+    uint32_t findFreeRun(uint32_t from, uint32_t to, uint32_t count) const;
+};
+
+struct VmMemoryOptions {
+    // bytes at the start of the arena faulted in while the vm starts.
+    uint64_t prefaultSize = 0;
+    // ask the kernel for transparent huge pages.
+    bool hugePages = false;
+    // 0 opens the whole arena at once, else it is opened by chunks of growSize.
+    uint64_t growSize = 0;
+};
+
+struct VmMemoryStats {
+    uint32_t committedPages;
+    // pages handed out, and pages freed but kept for reuse.
+    uint32_t usedPages;
+    uint32_t cachedPages;
+    // pages given back to the system by trim, in total.
+    uint64_t reclaimedPages;
+    // malloc and mallocSpan that went to the bitmap, and the words they looked at.
+    uint64_t bitmapMallocs;
+    uint64_t probes;
+    // pages of the arena backed by memory, found with mincore.
+    uint32_t residentPages;
+    // page faults of the whole process while the arena was built and prefaulted.
+    uint64_t initMinorFaults;
+    uint64_t initMajorFaults;
+    // page faults of the whole process since the arena was built.
+    uint64_t minorFaults;
+    uint64_t majorFaults;
+};
 
 class VmMemory {
 public:
@@ -16,6 +93,19 @@ public:
 
     virtual void free(void *p) = 0;
 
+    // count contiguous pages, for buffers bigger than a page.
+    virtual uint8_t *mallocSpan(uint32_t count) = 0;
+
+    virtual void freeSpan(void *p, uint32_t count) = 0;
+
+    // give unused memory back to the system, called while the vm is idle.
+    virtual void trim() = 0;
+
+    // give the free pages kept for reuse back to the system, all but keepPages.
+    virtual void release(uint32_t keepPages) = 0;
+
+    virtual VmMemoryStats getStats() const = 0;
+
     virtual ~VmMemory(){};
 };
 
@@ -26,12 +116,29 @@ private:
 
     // page
     uint32_t maxPageCount;
-    std::set<uint32_t> freePages;
-    std::set<uint32_t> fullPages;
-
+    // pages below it are read-write, the others are only reserved.
+    uint32_t committedPages;
+    uint32_t growPageCount;
+    // pages given back by free, still resident and reused first.
+    // the oldest ones are at the front.
+    std::vector<uint32_t> freePages;
+    // freePages.size(), read by trim without the lock.
+    std::atomic<uint32_t> freePageCount{0};
+    VmPageBitmap fullPages;
+    uint64_t reclaimedPages = 0;
+    uint64_t bitmapMallocs = 0;
+
+    // getrusage when the arena was built, and right after it was prefaulted.
+    uint64_t startMinorFaults;
+    uint64_t startMajorFaults;
+    uint64_t initMinorFaults;
+    uint64_t initMajorFaults;
+
+    // the arena is shared by the threads running the vm.
+    mutable std::mutex lock;
 
 public:
-    VmRandomMemory(uint64_t memSize);
+    explicit VmRandomMemory(uint64_t memSize, const VmMemoryOptions &options = VmMemoryOptions());
 
     ~VmRandomMemory();
 
@@ -39,9 +146,28 @@ public:
 
     void free(void *p) override;
 
+    uint8_t *mallocSpan(uint32_t count) override;
+
+    void freeSpan(void *p, uint32_t count) override;
+
+    void trim() override;
+
+    void release(uint32_t keepPages) override;
+
+    VmMemoryStats getStats() const override;
 
 private:
-    void freeToSystem();
+    // the lock is held by the callers of the ones below.
+    uint8_t *mallocPage();
+
+    void releasePages(uint32_t keepPages);
+
+    // open the next chunk of the arena, false once all of it is open.
+    bool grow();
+
+    void prefault(uint32_t count);
+
+    void freeToSystem(uint32_t memNum, uint32_t count);
 
     uint8_t *memNum2Mem(uint32_t memNum) const;
 
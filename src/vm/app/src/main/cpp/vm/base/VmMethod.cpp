@@ -6,6 +6,8 @@
 #include "../../common/VmConstant.h"
 #include "../../common/AndroidSystem.h"
 #include "../../VmContext.h"
+#include "VmDexCache.h"
+#include <vector>
 
 DexFile::DexFile(const u1 *base) {
     this->base = base;
@@ -26,25 +28,59 @@ DexFile::DexFile(const u1 *base) {
 }
 
 jstring VmMethod::resolveString(u4 idx) const {
-    const char *data = this->dexFile->dexStringById(idx);
-    LOG_D_VM("+++ resolving string=%s, referrer is %s", data, this->clazzDescriptor);
-    return VM_CONTEXT::env->NewStringUTF(data);
+    LOG_D_VM("+++ resolving string=%s, referrer is %s",
+             this->dexFile->dexStringById(idx), this->clazzDescriptor);
+    return VM_CONTEXT::vm->getResolveCache()->resolveString(this->dexCache, idx);
 }
 
 jclass VmMethod::resolveClass(u4 idx) const {
+    // never delete the returned class, a global ref or a local one of this frame.
+    jclass retClass = this->dexCache->classes.find(idx);
+    if (retClass != nullptr) {
+        return retClass;
+    }
     std::string clazzName = this->dexFile->dexStringByTypeIdx(idx);
-    jclass retClass;
     if (clazzName[0] != '\0' && clazzName[1] == '\0') {
         retClass = VM_CONTEXT::vm->findPrimitiveClass(clazzName[0]);
     } else {
         clazzName = clazzName.substr(1, clazzName.size() - 2);
+        // <clinit> may run.
+        VM_CONTEXT::vm->getArrayCache()->flush();
         retClass = (*VM_CONTEXT::env).FindClass(clazzName.data());
+        if (retClass != nullptr) {
+            retClass = VM_CONTEXT::vm->getResolveCache()->cacheClass(
+                    this->dexCache->classes, idx, retClass);
+        }
     }
     LOG_D_VM("--- resolving class %s (idx=%u referrer=%s)",
              clazzName.data(), idx, this->clazzDescriptor);
     return retClass;
 }
 
+jclass VmMethod::resolveElementClass(u4 idx) const {
+    // never delete the returned class, a global ref or a local one of this frame.
+    jclass retClass = this->dexCache->elementClasses.find(idx);
+    if (retClass != nullptr) {
+        return retClass;
+    }
+    std::string clazzName = this->dexFile->dexStringByTypeIdx(idx);
+    assert(clazzName.size() > 2 && clazzName[0] == '[');
+    if (clazzName[1] == 'L') {
+        clazzName = clazzName.substr(2, clazzName.size() - 3);
+    } else {
+        clazzName = clazzName.substr(1);
+    }
+    // <clinit> may run.
+    VM_CONTEXT::vm->getArrayCache()->flush();
+    retClass = (*VM_CONTEXT::env).FindClass(clazzName.data());
+    if (retClass != nullptr) {
+        retClass = VM_CONTEXT::vm->getResolveCache()->cacheClass(
+                this->dexCache->elementClasses, idx, retClass);
+    }
+    LOG_D_VM("--- resolving element class %s (idx=%u referrer=%s)",
+             clazzName.data(), idx, this->clazzDescriptor);
+    return retClass;
+}
 
 std::string VmMethod::getClassDescriptorByJClass(jclass clazz) {
     JNIEnv *env = VM_CONTEXT::env;
@@ -57,18 +93,17 @@ std::string VmMethod::getClassDescriptorByJClass(jclass clazz) {
     LOG_D_VM("descriptor: %s", javaDescChars);
     std::string retVal(javaDescChars);
     (*env).ReleaseStringUTFChars(utfString, javaDescChars);
-//    (*env).DeleteLocalRef(utfString);
-//    (*env).DeleteLocalRef(cClass);
+    (*env).DeleteLocalRef(utfString);
+    (*env).DeleteLocalRef(cClass);
     return retVal;
 }
 
 jarray VmMethod::allocArray(s4 len, u4 idx) const {
-    std::string clazzName = this->dexFile->dexStringById(idx);
+    std::string clazzName = this->dexFile->dexStringByTypeIdx(idx);
     LOG_D_VM("--- resolving class %s (idx=%u referrer=%s)", clazzName.data(), idx,
              this->clazzDescriptor);
     assert(clazzName[0] == '[');
     jclass elementClazz;
-    jarray retValue;
     switch (clazzName[1]) {
         case 'I':
             return (*VM_CONTEXT::env).NewIntArray(len);
@@ -87,19 +122,10 @@ jarray VmMethod::allocArray(s4 len, u4 idx) const {
         case 'J':
             return (*VM_CONTEXT::env).NewLongArray(len);
         case '[':
-            elementClazz = (*VM_CONTEXT::env).FindClass(
-                    clazzName.substr(1, clazzName.size() - 1).data());
-            if (elementClazz == nullptr) { return nullptr; }
-            retValue = (*VM_CONTEXT::env).NewObjectArray(len, elementClazz, nullptr);
-//            (*VM_CONTEXT::env).DeleteLocalRef(elementClazz);
-            return retValue;
         case 'L':
-            elementClazz = (*VM_CONTEXT::env).FindClass(
-                    clazzName.substr(2, clazzName.size() - 3).data());
+            elementClazz = this->resolveElementClass(idx);
             if (elementClazz == nullptr) { return nullptr; }
-            retValue = (*VM_CONTEXT::env).NewObjectArray(len, elementClazz, nullptr);
-//            (*VM_CONTEXT::env).DeleteLocalRef(elementClazz);
-            return retValue;
+            return (*VM_CONTEXT::env).NewObjectArray(len, elementClazz, nullptr);
         default:
             LOG_E("Unknown primitive type '%s'", clazzName.data() + 1);
             return nullptr;
@@ -127,12 +153,7 @@ bool VmMethod::resolveField(u4 idx, jobject obj, RegValue *retVal) const {
     }
     const char *fName = this->dexFile->dexStringById(pFieldId->nameIdx);
     const char *fSign = this->dexFile->dexStringByTypeIdx(pFieldId->typeIdx);
-    jfieldID resField = nullptr;
-    if (obj == nullptr) {
-        resField = (*env).GetStaticFieldID(resClazz, fName, fSign);
-    } else {
-        resField = (*env).GetFieldID(resClazz, fName, fSign);
-    }
+    jfieldID resField = this->resolveFieldId(idx, resClazz, obj == nullptr);
     if (resField == nullptr) {
         LOG_E("can't found field: %s in class: %s",
               fName, VmMethod::getClassDescriptorByJClass(resClazz).data());
@@ -188,6 +209,25 @@ bool VmMethod::resolveField(u4 idx, jobject obj, RegValue *retVal) const {
     return true;
 }
 
+jfieldID VmMethod::resolveFieldId(u4 idx, jclass clazz, bool isStatic) const {
+    jfieldID ret = this->dexCache->fields.find(idx);
+    if (ret != nullptr) {
+        return ret;
+    }
+    const DexFieldId *pFieldId = this->dexFile->dexGetFieldId(idx);
+    const char *fName = this->dexFile->dexStringById(pFieldId->nameIdx);
+    const char *fSign = this->dexFile->dexStringByTypeIdx(pFieldId->typeIdx);
+    if (isStatic) {
+        ret = (*VM_CONTEXT::env).GetStaticFieldID(clazz, fName, fSign);
+    } else {
+        ret = (*VM_CONTEXT::env).GetFieldID(clazz, fName, fSign);
+    }
+    if (ret != nullptr) {
+        ret = this->dexCache->fields.publish(idx, ret);
+    }
+    return ret;
+}
+
 const char *VmMethod::resolveFieldName(u4 idx) const {
     const DexFieldId *pFieldId = this->dexFile->dexGetFieldId(idx);
     LOG_D_VM("--- resolving field %s (referrer=%s)",
@@ -207,12 +247,7 @@ bool VmMethod::resolveSetField(u4 idx, jobject obj, const RegValue *val) const {
     }
     const char *fName = this->dexFile->dexStringById(pFieldId->nameIdx);
     const char *fSign = this->dexFile->dexStringByTypeIdx(pFieldId->typeIdx);
-    jfieldID resField;
-    if (obj == nullptr) {
-        resField = (*env).GetStaticFieldID(resClazz, fName, fSign);
-    } else {
-        resField = (*env).GetFieldID(resClazz, fName, fSign);
-    }
+    jfieldID resField = this->resolveFieldId(idx, resClazz, obj == nullptr);
     if (resField == nullptr) {
         LOG_E("can't found field: %s in class: %s",
               fName, VmMethod::getClassDescriptorByJClass(resClazz).data());
@@ -280,6 +315,10 @@ bool VmMethod::resolveSetField(u4 idx, jobject obj, const RegValue *val) const {
 }
 
 jmethodID VmMethod::resolveMethod(u4 idx, bool isStatic) const {
+    jmethodID ret = this->dexCache->methods.find(idx);
+    if (ret != nullptr) {
+        return ret;
+    }
     const DexMethodId *dexMethodId = this->dexFile->dexGetMethodId(idx);
     const char *resName = this->dexFile->dexStringById(dexMethodId->nameIdx);
     LOG_D_VM("--- resolving method=%s (idx=%u class=%s)", resName, idx,
@@ -289,12 +328,14 @@ jmethodID VmMethod::resolveMethod(u4 idx, bool isStatic) const {
     if (resClass == nullptr) {
         return nullptr;
     }
-    jmethodID ret;
     if (isStatic) {
         ret = (*VM_CONTEXT::env).GetStaticMethodID(resClass, resName, sign.data());
     } else {
         ret = (*VM_CONTEXT::env).GetMethodID(resClass, resName, sign.data());
     }
+    if (ret != nullptr) {
+        ret = this->dexCache->methods.publish(idx, ret);
+    }
     return ret;
 }
 
@@ -320,7 +361,8 @@ VmMethod *VmMethod::reset(jmethodID jniMethod, bool isUpdateCode) {
     auto *artClass = (ArtClass *) (uint64_t) ((ArtMethod_26_28 *) artMethod)->declaring_class;
     void *artDexCache = (void *) (uint64_t) artClass->dex_cache;
     auto *artDexFile = (ArtDexFile_28 *) ((ArtDexCache_26_28 *) artDexCache)->dex_file;
-    this->dexFile = new DexFile(artDexFile->begin);
+    this->dexCache = VM_CONTEXT::vm->getResolveCache()->getDexCache(artDexFile->begin);
+    this->dexFile = &this->dexCache->dexFile;
     const DexMethodId *pDexMethodId =
             this->dexFile->dexGetMethodId(((ArtMethod_26_28 *) artMethod)->dex_method_index);
     this->protoId = this->dexFile->dexGetProtoId(pDexMethodId->protoIdx);
@@ -345,7 +387,7 @@ VmMethod *VmMethod::reset(jmethodID jniMethod, bool isUpdateCode) {
 void VmMethodContext::printVmMethodContext() const {
     LOG_D("current method: %s#%s", this->method->clazzDescriptor, this->method->name);
     for (int i = 0; i < this->method->code->registersSize; ++i) {
-        LOG_D("reg[%d]: 0x%016lx", i, this->reg[i].u8);
+        LOG_D("reg[%d]: 0x%08x%s", i, this->reg[i], this->isRegisterObject(i) ? " (object)" : "");
     }
 
     LOG_D("src1: 0x%04x, src2: 0x%04x, dst: 0x%04x",
@@ -366,31 +408,44 @@ void VmMethodContext::printMethodInsns() const {
 }
 #endif
 
-uint32_t VmMethodContext::regCacheKey = 0;
-uint32_t VmMethodContext::methodCacheKey = 0;
+thread_local VmCacheType *VmMethodContext::regCacheType = nullptr;
+thread_local VmCacheType *VmMethodContext::methodCacheType = nullptr;
 
 void VmMethodContext::resetWithoutParams(jmethodID methodId, jvalue *pResult) {
-    if (VmMethodContext::regCacheKey == 0 || VmMethodContext::methodCacheKey == 0) {
-        assert(VmMethodContext::regCacheKey == 0);
-        assert(VmMethodContext::methodCacheKey == 0);
-        VmMethodContext::regCacheKey = VM_CONTEXT::vm->newCacheType(sizeof(RegValue));
-        VmMethodContext::methodCacheKey = VM_CONTEXT::vm->newCacheType(sizeof(VmMethod));
-    }
-    assert(VmMethodContext::regCacheKey != 0);
-    assert(VmMethodContext::methodCacheKey != 0);
-
-    this->method = ((VmMethod *) VM_CONTEXT::vm->mallocCache(
-            VmMethodContext::methodCacheKey, 1))->reset(methodId, true);
-    assert(this->method->code != nullptr);
+    if (VmMethodContext::regCacheType == nullptr || VmMethodContext::methodCacheType == nullptr) {
+        assert(VmMethodContext::regCacheType == nullptr);
+        assert(VmMethodContext::methodCacheType == nullptr);
+        VmMethodContext::regCacheType = VM_CONTEXT::vm->newCacheType(sizeof(u4));
+        VmMethodContext::methodCacheType = VM_CONTEXT::vm->newCacheType(sizeof(VmMethod));
+    }
+    assert(VmMethodContext::regCacheType != nullptr);
+    assert(VmMethodContext::methodCacheType != nullptr);
+
+    const VmMethod *pMethod = ((VmMethod *) VM_CONTEXT::vm->mallocCache(
+            VmMethodContext::methodCacheType, 1))->reset(methodId, true);
+    auto *regs = (u4 *) VM_CONTEXT::vm->mallocCache(
+            VmMethodContext::regCacheType,
+            VmMethodContext::regBufferCount(pMethod->code->registersSize));
+    this->bind(pMethod, regs, pResult);
+}
+
+void VmMethodContext::bind(const VmMethod *pMethod, u4 *regs, jvalue *pResult) {
+    assert(pMethod->code != nullptr);
+    this->method = pMethod;
     this->retVal = pResult;
-    this->reg = (RegValue *) VM_CONTEXT::vm->mallocCache(
-            VmMethodContext::regCacheKey, this->method->code->registersSize);
-    this->pc = 0;
     this->tmp = VM_CONTEXT::vm->getTempDataBuf();
+    // the register object bits and the refBase are kept behind the registers.
+    const uint32_t regCount = this->method->code->registersSize;
+    this->reg = regs;
+    this->refBits = (uint64_t *) (this->reg + ((regCount + 1u) & ~1u));
+    memset(this->refBits, 0, VmMethodContext::refWordCount(regCount) * sizeof(uint64_t));
+    this->refBase() = this->tmp->refs.size();
+    this->pc = 0;
+    this->curException = nullptr;
     this->state = VmMethodContextState::Running;
 }
 
-void VmMethodContext::pushParams(jobject caller, va_list param) const {
+void VmMethodContext::pushParams(jobject caller, va_list param) {
     // 参数入寄存器
     // [0] is return value.
     const char *desc = this->method->dexFile->dexStringById(method->protoId->shortyIdx) + 1;
@@ -399,7 +454,7 @@ void VmMethodContext::pushParams(jobject caller, va_list param) const {
 
     // push this
     if (!DexFile::isStaticMethod(this->method->accessFlags)) {
-        this->reg[startReg].l = caller;
+        this->setRegisterAsObject(startReg, caller);
         startReg++;
         verifyCount++;
     }
@@ -409,21 +464,21 @@ void VmMethodContext::pushParams(jobject caller, va_list param) const {
         switch (*desc++) {
             case 'D':
             case 'J': {
-                this->reg[startReg].j = va_arg(param, jlong);
+                this->setRegisterLong(startReg, va_arg(param, jlong));
                 startReg += 2;
                 verifyCount += 2;
                 break;
             }
 
             case 'L': {     /* 'shorty' descr uses L for all refs, incl array */
-                this->reg[startReg].l = va_arg(param, jobject);
+                this->setRegisterAsObject(startReg, va_arg(param, jobject));
                 startReg++;
                 verifyCount++;
                 break;
             }
             default: {
                 /* Z B C S I F -- all passed as 32-bit integers */
-                this->reg[startReg].i = va_arg(param, jint);
+                this->setRegisterInt(startReg, va_arg(param, jint));
                 startReg++;
                 verifyCount++;
                 break;
@@ -440,6 +495,56 @@ void VmMethodContext::pushParams(jobject caller, va_list param) const {
     }
 }
 
+void VmMethodContext::pushParams(jobject caller, const jvalue *params) {
+    const char *desc = this->method->getShorty() + 1;
+    u4 startReg = this->method->code->registersSize - this->method->code->insSize;
+    if (!DexFile::isStaticMethod(this->method->accessFlags)) {
+        this->setRegisterAsObject(startReg++, caller);
+    }
+    for (; *desc != '\0'; desc++, params++) {
+        switch (*desc) {
+            case 'D':
+            case 'J':
+                this->setRegisterLong(startReg, params->j);
+                startReg += 2;
+                break;
+
+            case 'L':
+                this->setRegisterAsObject(startReg++, params->l);
+                break;
+
+            case 'F':
+                this->setRegisterFloat(startReg++, params->f);
+                break;
+
+            case 'Z':
+                this->setRegisterInt(startReg++, params->z);
+                break;
+
+            case 'B':
+                this->setRegisterInt(startReg++, params->b);
+                break;
+
+            case 'C':
+                this->setRegisterInt(startReg++, params->c);
+                break;
+
+            case 'S':
+                this->setRegisterInt(startReg++, params->s);
+                break;
+
+            default:
+                this->setRegisterInt(startReg++, params->i);
+                break;
+        }
+    }
+    if (startReg != this->method->code->registersSize) {
+        LOG_E("Got vfy reg=%u registersSize=%d for %s",
+              startReg, this->method->code->registersSize, this->method->name);
+        throw VMException("error param, and can't push them to vm reg.");
+    }
+}
+
 void VmMethodContext::reset(
         jobject caller, jmethodID methodId, jvalue *pResult, va_list param) {
     this->resetWithoutParams(methodId, pResult);
@@ -447,6 +552,81 @@ void VmMethodContext::reset(
 }
 
 void VmMethodContext::release() const {
-    VM_CONTEXT::vm->freeCache(VmMethodContext::methodCacheKey, 1);
-    VM_CONTEXT::vm->freeCache(VmMethodContext::regCacheKey, this->method->code->registersSize);
+    const uint32_t regCount = this->method->code->registersSize;
+    VM_CONTEXT::vm->freeCache(VmMethodContext::methodCacheType, 1);
+    VM_CONTEXT::vm->freeCache(
+            VmMethodContext::regCacheType, VmMethodContext::regBufferCount(regCount));
+}
+
+bool VmMethodContext::isSameObject(uint32_t off1, uint32_t off2) const {
+    jobject obj1 = this->getRegisterAsObject(off1);
+    jobject obj2 = this->getRegisterAsObject(off2);
+    if (obj1 == nullptr || obj2 == nullptr) {
+        return obj1 == obj2;
+    }
+    return obj1 == obj2 || (*VM_CONTEXT::env).IsSameObject(obj1, obj2);
+}
+
+void VmMethodContext::onBackEdgePeriod() {
+    this->reclaimLocalRefs();
+    // the only cost of a call without a budget.
+    if (this->tmp->hasBudget) {
+        VM_CONTEXT::vm->chargeBudget(this, VM_CONFIG::VM_LOCAL_FRAME_RECLAIM_PERIOD);
+    }
+}
+
+/**
+ * drop the current jni local frame and build a new one which only holds
+ * the references still live in registers. The frame's entries of tmp->refs
+ * are compacted the same way, the entries of the callers are left alone.
+ */
+void VmMethodContext::reclaimLocalRefs() {
+    JNIEnv *env = VM_CONTEXT::env;
+    std::vector<jobject> &refs = this->tmp->refs;
+    const auto base = (u4) this->refBase();
+    // first: the old ref, second: a ref which survives the local frame.
+    std::vector<std::pair<jobject, jobject>> liveRefs;
+    std::vector<bool> isLocal;
+    const uint32_t wordCount = VmMethodContext::refWordCount(this->method->code->registersSize);
+    for (uint32_t w = 0; w < wordCount; w++) {
+        for (uint64_t bits = this->refBits[w]; bits != 0; bits &= bits - 1) {
+            uint32_t off = (w << 6u) + __builtin_ctzll(bits);
+            if (this->reg[off] < base) {
+                // null or a caller's entry, both outlive this local frame.
+                continue;
+            }
+            jobject ref = refs[this->reg[off]];
+            u4 pos = 0;
+            while (pos < liveRefs.size() && liveRefs[pos].first != ref) {
+                pos++;
+            }
+            if (pos == liveRefs.size()) {
+                // global refs survive the local frame.
+                bool local = !VM_CONTEXT::vm->getResolveCache()->isCachedRef(ref);
+                liveRefs.emplace_back(ref, local ? (*env).NewGlobalRef(ref) : ref);
+                isLocal.push_back(local);
+            }
+            // the entries are rebuilt in the order of liveRefs.
+            this->reg[off] = base + pos;
+        }
+    }
+
+    VM_CONTEXT::vm->getArrayCache()->releaseFrame();
+    (*env).PopLocalFrame(nullptr);
+    this->tmp->refEpoch++;
+    if ((*env).PushLocalFrame(VM_CONFIG::VM_LOCAL_FRAME_CAPACITY) < 0) {
+        LOG_E("can't push the jni local frame.");
+        throw VMException("can't push the jni local frame.");
+    }
+
+    refs.resize(base);
+    for (u4 pos = 0; pos < liveRefs.size(); pos++) {
+        if (isLocal[pos]) {
+            refs.push_back((*env).NewLocalRef(liveRefs[pos].second));
+            (*env).DeleteGlobalRef(liveRefs[pos].second);
+        } else {
+            refs.push_back(liveRefs[pos].second);
+        }
+    }
+    LOG_D_VM("reclaim local refs, live: %zu", liveRefs.size());
 }
@@ -6,11 +6,14 @@
 #define VM_VMMETHOD_H
 
 
+#include <cstring>
 #include <jni.h>
 #include "../../common/Util.h"
 #include "../../common/AndroidSystem.h"
+#include "../../common/VmConstant.h"
 #include "VmCommon.h"
 #include "VmMemory.h"
+#include "VmCache.h"
 
 class DexFile {
 public:
@@ -104,9 +107,13 @@ public:
     }
 };
 
+class VmDexCache;
+
 class VmMethod {
 public:
     DexFile *dexFile;
+    // the resolved ids of dexFile, shared by every thread.
+    VmDexCache *dexCache;
     const char *name;
     const char *clazzDescriptor;
     const DexProtoId *protoId;
@@ -122,6 +129,8 @@ public:
 
     jclass resolveClass(u4 idx) const;
 
+    jclass resolveElementClass(u4 idx) const;
+
     jmethodID resolveMethod(u4 idx, bool isStatic) const;
 
     std::string resolveMethodSign(u4 idx) const;
@@ -132,8 +141,14 @@ public:
 
     bool resolveSetField(u4 idx, jobject obj, const RegValue *val) const;
 
+    jfieldID resolveFieldId(u4 idx, jclass clazz, bool isStatic) const;
+
     jarray allocArray(const s4 len, u4 idx) const;
 
+    inline const char *getShorty() const {
+        return this->dexFile->dexStringById(this->protoId->shortyIdx);
+    }
+
     static std::string getClassDescriptorByJClass(jclass clazz);
 };
 
@@ -155,7 +170,10 @@ enum VmMethodContextState {
 class VmMethodContext {
 public:
     const VmMethod *method;
-    RegValue *reg;
+    // 32-bit dalvik registers, a wide value takes the pair vN, vN+1.
+    u4 *reg;
+    // one bit per register, set if the register holds an index into tmp->refs.
+    uint64_t *refBits;
     VmTempData *tmp;
 
     jvalue *retVal;
@@ -165,8 +183,9 @@ private:
     VmMethodContextState state;
     uint16_t pc;
 
-    static uint32_t regCacheKey;
-    static uint32_t methodCacheKey;
+    // of the calling thread's vm cache.
+    static thread_local VmCacheType *regCacheType;
+    static thread_local VmCacheType *methodCacheType;
 
 public:
     inline void setState(VmMethodContextState contextState) {
@@ -200,10 +219,38 @@ public:
 
     void resetWithoutParams(jmethodID methodId, jvalue *pResult);
 
-    void pushParams(jobject caller, va_list param) const;
+    // use the method and the registers allocated by the caller.
+    void bind(const VmMethod *pMethod, u4 *regs, jvalue *pResult);
+
+    void pushParams(jobject caller, va_list param);
+
+    // one jvalue per parameter, as the Call<type>MethodA of jni.
+    void pushParams(jobject caller, const jvalue *params);
 
     void release() const;
 
+    void reclaimLocalRefs();
+
+    // every VM_LOCAL_FRAME_RECLAIM_PERIOD backward branches of the thread.
+    void onBackEdgePeriod();
+
+    // one bit per register, a wide pair never reaches beyond registersSize.
+    static inline uint32_t refWordCount(uint32_t registersSize) {
+        return (registersSize + 63u) >> 6u;
+    }
+
+    // u4 slots of the registers, their object bits and the frame's refBase,
+    // always even so that every buffer stays 8 bytes aligned.
+    static inline uint32_t regBufferCount(uint32_t registersSize) {
+        return ((registersSize + 1u) & ~1u)
+               + (VmMethodContext::refWordCount(registersSize) + 1u) * 2u;
+    }
+
+    // the first entry of tmp->refs owned by this frame.
+    inline uint64_t &refBase() const {
+        return this->refBits[VmMethodContext::refWordCount(this->method->code->registersSize)];
+    }
+
     inline bool isCallFromVm() {
         return this->isMethodToCall();
     }
@@ -258,6 +305,10 @@ public:
         return this->pc;
     }
 
+    inline const u2 *cur_insns() const {
+        return this->method->code->insns + this->pc;
+    }
+
     inline void set_pc(uint32_t off) {
         assert(off < this->method->code->insnsSize);
         this->pc = off;
@@ -266,6 +317,11 @@ public:
     inline void goto_off(int32_t off) {
         this->pc = this->pc + off;
         assert(0 <= this->pc && this->pc <= this->method->code->insnsSize);
+        if (off <= 0 &&
+            ++this->tmp->backEdges >= VM_CONFIG::VM_LOCAL_FRAME_RECLAIM_PERIOD) {
+            this->tmp->backEdges = 0;
+            this->onBackEdgePeriod();
+        }
     }
 
     inline const u2 *arrayData(s4 off) {
@@ -274,60 +330,113 @@ public:
         return this->method->code->insns + data_off;
     }
 
+    inline bool isRegisterObject(uint32_t off) const {
+        return (this->refBits[off >> 6u] >> (off & 0x3fu)) & 1u;
+    }
+
+    inline void markRegisterObject(uint32_t off) {
+        this->refBits[off >> 6u] |= 1UL << (off & 0x3fu);
+    }
+
+    inline void clearRegisterObject(uint32_t off) {
+        this->refBits[off >> 6u] &= ~(1UL << (off & 0x3fu));
+    }
+
+    inline void clearRegisterObjectWide(uint32_t off) {
+        this->clearRegisterObject(off);
+        this->clearRegisterObject(off + 1);
+    }
+
     inline u4 getRegister(uint32_t off) const {
-        return this->reg[off].u4;
+        return this->reg[off];
     }
 
     inline void setRegister(uint32_t off, u4 val) {
-        this->reg[off].u4 = val;
+        this->clearRegisterObject(off);
+        this->reg[off] = val;
     }
 
     inline jint getRegisterInt(uint32_t off) const {
-        return this->reg[off].i;
+        return (jint) this->reg[off];
     }
 
     inline void setRegisterInt(uint32_t off, jint val) {
-        this->reg[off].i = val;
+        this->clearRegisterObject(off);
+        this->reg[off] = (u4) val;
     }
 
+    // the low half in vN and the high half in vN+1, as dalvik does.
     inline u8 getRegisterWide(uint32_t off) const {
-        return this->reg[off].u8;
+        u8 val;
+        memcpy(&val, this->reg + off, sizeof(val));
+        return val;
     }
 
     inline void setRegisterWide(uint32_t off, u8 val) {
-        this->reg[off].u8 = val;
+        this->clearRegisterObjectWide(off);
+        memcpy(this->reg + off, &val, sizeof(val));
     }
 
     inline jobject getRegisterAsObject(uint32_t off) const {
-        return this->reg[off].l;
+        return this->tmp->refs[this->reg[off]];
     }
 
     inline void setRegisterAsObject(uint32_t off, jobject val) {
-        this->reg[off].l = val;
+        this->markRegisterObject(off);
+        if (val == nullptr) {
+            this->reg[off] = 0;
+        } else {
+            this->reg[off] = (u4) this->tmp->refs.size();
+            this->tmp->refs.push_back(val);
+        }
+    }
+
+    // copy an object register without a new entry in tmp->refs, the entries
+    // of a caller live as long as its callee.
+    inline void moveRegisterObject(uint32_t off, const VmMethodContext *src, uint32_t srcOff) {
+        this->markRegisterObject(off);
+        this->reg[off] = src->reg[srcOff];
     }
 
+    // if-eq and if-ne, two object registers may hold different entries of one object.
+    inline bool isRegisterEqual(uint32_t off1, uint32_t off2) const {
+        if (this->reg[off1] == this->reg[off2]) {
+            return true;
+        }
+        return this->isRegisterObject(off1) && this->isRegisterObject(off2) &&
+               this->isSameObject(off1, off2);
+    }
+
+    bool isSameObject(uint32_t off1, uint32_t off2) const;
+
     inline jfloat getRegisterFloat(uint32_t off) const {
-        return this->reg[off].f;
+        jfloat val;
+        memcpy(&val, this->reg + off, sizeof(val));
+        return val;
     }
 
     inline void setRegisterFloat(uint32_t off, jfloat val) {
-        this->reg[off].f = val;
+        this->clearRegisterObject(off);
+        memcpy(this->reg + off, &val, sizeof(val));
     }
 
-    inline jfloat getRegisterDouble(uint32_t off) const {
-        return this->reg[off].f;
+    inline jdouble getRegisterDouble(uint32_t off) const {
+        jdouble val;
+        memcpy(&val, this->reg + off, sizeof(val));
+        return val;
     }
 
     inline void setRegisterDouble(uint32_t off, jdouble val) {
-        this->reg[off].d = val;
+        this->clearRegisterObjectWide(off);
+        memcpy(this->reg + off, &val, sizeof(val));
     }
 
     inline jlong getRegisterLong(uint32_t off) const {
-        return this->reg[off].j;
+        return (jlong) this->getRegisterWide(off);
     }
 
     inline void setRegisterLong(uint32_t off, jlong val) {
-        this->reg[off].j = val;
+        this->setRegisterWide(off, (u8) val);
     }
 };
 
@@ -0,0 +1,42 @@
+//
+// Created by 陈泽伦 on 1/12/21.
+//
+
+#include "VmRandom.h"
+#include <random>
+
+thread_local VmRandom::State VmRandom::state{};
+// starts at 1, so a state never seeded is always behind.
+std::atomic<uint32_t> VmRandom::seedGeneration(1);
+std::atomic<uint64_t> VmRandom::fixedSeed(0);
+std::atomic<uint64_t> VmRandom::threadCount(0);
+
+static inline uint64_t splitMix64(uint64_t &x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30u)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27u)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31u);
+}
+
+void VmRandom::seed(uint64_t seed) {
+    VmRandom::fixedSeed.store(seed, std::memory_order_relaxed);
+    VmRandom::threadCount.store(0, std::memory_order_relaxed);
+    uint32_t generation = VmRandom::seedGeneration.load(std::memory_order_relaxed) + 1;
+    // 0 is kept for the states never seeded.
+    VmRandom::seedGeneration.store(generation == 0 ? 1 : generation, std::memory_order_release);
+}
+
+void VmRandom::init(State &st) {
+    st.generation = VmRandom::seedGeneration.load(std::memory_order_acquire);
+    uint64_t x = VmRandom::fixedSeed.load(std::memory_order_relaxed);
+    if (x != 0) {
+        x ^= VmRandom::threadCount.fetch_add(1, std::memory_order_relaxed) * 0xd1342543de82ef95ULL;
+    } else {
+        std::random_device device;
+        x = ((uint64_t) device() << 32u) | device();
+    }
+    // splitmix64 never gives four zero words, the one state xoshiro can't leave.
+    for (uint64_t &it : st.s) {
+        it = splitMix64(x);
+    }
+}
@@ -0,0 +1,68 @@
+//
+// Created by 陈泽伦 on 1/12/21.
+//
+
+#ifndef VM_VMRANDOM_H
+#define VM_VMRANDOM_H
+
+#include <cstdint>
+#include <atomic>
+
+/**
+ * xoshiro256** of every thread, used by the randomized allocators instead of
+ * random(), which takes a global lock. A thread seeds itself on first use,
+ * from std::random_device or from the seed given to VmRandom::seed.
+ */
+class VmRandom {
+private:
+    struct State {
+        uint64_t s[4];
+        // seedGeneration this state was seeded in, 0 if never.
+        uint32_t generation;
+    };
+
+    static thread_local State state;
+    static std::atomic<uint32_t> seedGeneration;
+    // 0 for random seeds.
+    static std::atomic<uint64_t> fixedSeed;
+    // threads seeded since the last VmRandom::seed, they get distinct streams.
+    static std::atomic<uint64_t> threadCount;
+
+public:
+    /**
+     * every thread reseeds on its next use, the n-th of them from seed and n,
+     * so a run on one thread is reproducible. 0 goes back to random seeds.
+     */
+    static void seed(uint64_t seed);
+
+    static inline uint64_t next() {
+        State &st = VmRandom::state;
+        if (st.generation != VmRandom::seedGeneration.load(std::memory_order_relaxed)) {
+            VmRandom::init(st);
+        }
+        const uint64_t ret = VmRandom::rotl(st.s[1] * 5u, 7) * 9u;
+        const uint64_t t = st.s[1] << 17u;
+        st.s[2] ^= st.s[0];
+        st.s[3] ^= st.s[1];
+        st.s[1] ^= st.s[2];
+        st.s[0] ^= st.s[3];
+        st.s[2] ^= t;
+        st.s[3] = VmRandom::rotl(st.s[3], 45);
+        return ret;
+    }
+
+    // in [0, bound), without the bias and the division of a modulo.
+    static inline uint32_t below(uint32_t bound) {
+        return (uint32_t) (((next() >> 32u) * bound) >> 32u);
+    }
+
+private:
+    static void init(State &st);
+
+    static inline uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+
+#endif //VM_VMRANDOM_H
@@ -0,0 +1,229 @@
+//
+// Created by 陈泽伦 on 1/5/21.
+//
+
+#include "VmResolveCache.h"
+#include "../../common/Util.h"
+#include "../../common/VmConstant.h"
+#include "../../VmContext.h"
+
+VmRefTable::VmRefTable(u4 count) {
+    assert(count != 0 && (count & (count - 1)) == 0);
+    this->mask = count - 1;
+    this->slots = (Slot *) calloc(count, sizeof(Slot));
+    if (this->slots == nullptr) {
+        throw VMException("can't alloc the ref table.");
+    }
+}
+
+VmRefTable::~VmRefTable() {
+    ::free(this->slots);
+}
+
+bool VmRefTable::insert(jobject ref, uintptr_t val) {
+    assert(ref != nullptr && val != 0);
+    for (u4 i = VmRefTable::hash(ref), n = 0; n <= this->mask; i++, n++) {
+        Slot &slot = this->slots[i & this->mask];
+        jobject key = nullptr;
+        if (slot.ref.compare_exchange_strong(
+                key, ref, std::memory_order_acq_rel, std::memory_order_acquire) || key == ref) {
+            slot.val.store(val, std::memory_order_release);
+            return true;
+        }
+    }
+    LOG_W("ref table is full, ref: %p", ref);
+    return false;
+}
+
+void VmRefTable::clear() {
+    memset((void *) this->slots, 0, sizeof(Slot) * (this->mask + 1));
+}
+
+VmDexCache *VmResolveCache::getDexCache(const u1 *begin) {
+    u4 count = this->dexCacheCount.load(std::memory_order_acquire);
+    for (u4 i = 0; i < count; i++) {
+        VmDexCache *dexCache = this->dexCaches[i].load(std::memory_order_relaxed);
+        if (dexCache->getBegin() == begin) {
+            return dexCache;
+        }
+    }
+    std::lock_guard<std::mutex> guard(this->dexLock);
+    // another thread may have added it.
+    count = this->dexCacheCount.load(std::memory_order_relaxed);
+    for (u4 i = 0; i < count; i++) {
+        VmDexCache *dexCache = this->dexCaches[i].load(std::memory_order_relaxed);
+        if (dexCache->getBegin() == begin) {
+            return dexCache;
+        }
+    }
+    if (count == VM_CONFIG::VM_RESOLVE_CACHE_DEX_FILES) {
+        LOG_E("too many dex files: %u", count);
+        throw VMException("too many dex files.");
+    }
+    auto *dexCache = new VmDexCache(begin);
+    this->dexCaches[count].store(dexCache, std::memory_order_relaxed);
+    this->dexCacheCount.store(count + 1, std::memory_order_release);
+    return dexCache;
+}
+
+jstring VmResolveCache::resolveString(VmDexCache *dexCache, u4 idx) {
+    VmStringEntry *entry = dexCache->strings.find(idx);
+    if (entry != nullptr) {
+        return entry->str;
+    }
+
+    JNIEnv *env = VM_CONTEXT::env;
+    jmethodID intern = this->mIntern.load(std::memory_order_acquire);
+    if (intern == nullptr) {
+        // the same jmethodID for every thread racing here.
+        jclass cString = (*env).FindClass(VM_REFLECT::C_NAME_String);
+        intern = (*env).GetMethodID(
+                cString, VM_REFLECT::NAME_String_intern, VM_REFLECT::SIGN_String_intern);
+        (*env).DeleteLocalRef(cString);
+        assert(intern != nullptr);
+        this->mIntern.store(intern, std::memory_order_release);
+    }
+
+    const char *data = dexCache->dexFile.dexStringById(idx);
+    std::vector<jchar> chars;
+    VmResolveCache::decodeMUTF8(data, chars);
+    jstring str = (*env).NewString(chars.data(), chars.size());
+    if (str == nullptr) {
+        return nullptr;
+    }
+    // const-string must be the same instance as the string literal in java.
+    auto interned = (jstring) (*env).CallObjectMethod(str, intern);
+    (*env).DeleteLocalRef(str);
+    if (interned == nullptr) {
+        return nullptr;
+    }
+    if (!dexCache->strings.claim(idx)) {
+        // resolved by another thread meanwhile, or still being published.
+        entry = dexCache->strings.find(idx);
+        if (entry == nullptr) {
+            return interned;
+        }
+        (*env).DeleteLocalRef(interned);
+        return entry->str;
+    }
+    entry = new VmStringEntry();
+    entry->chars.swap(chars);
+    entry->str = (jstring) (*env).NewGlobalRef(interned);
+    (*env).DeleteLocalRef(interned);
+    LOG_D_VM("cache string: %s, ref: %p", data, entry->str);
+    // recorded before it is published, a reader never misses it.
+    this->refs.insert(entry->str, (uintptr_t) entry);
+    dexCache->strings.publishClaimed(idx, entry);
+    return entry->str;
+}
+
+jclass VmResolveCache::cacheClass(VmSlotArray<jclass> &slots, u4 idx, jclass clazz) {
+    JNIEnv *env = VM_CONTEXT::env;
+    if (!slots.claim(idx)) {
+        jclass ret = slots.find(idx);
+        if (ret == nullptr) {
+            // valid until the jni local frame is popped.
+            return clazz;
+        }
+        (*env).DeleteLocalRef(clazz);
+        return ret;
+    }
+    auto ret = (jclass) (*env).NewGlobalRef(clazz);
+    (*env).DeleteLocalRef(clazz);
+    this->refs.insert(ret, kRefClass);
+    slots.publishClaimed(idx, ret);
+    return ret;
+}
+
+jobject VmResolveCache::cacheInteger(jint value, jobject box) {
+    JNIEnv *env = VM_CONTEXT::env;
+    const u4 idx = value - VM_INTEGER_CACHE_LOW;
+    if (!this->integers.claim(idx)) {
+        jobject ret = this->integers.find(idx);
+        if (ret == nullptr) {
+            return box;
+        }
+        (*env).DeleteLocalRef(box);
+        return ret;
+    }
+    jobject ret = (*env).NewGlobalRef(box);
+    (*env).DeleteLocalRef(box);
+    this->refs.insert(ret, (uintptr_t) (u4) value << 32u | kRefInteger);
+    this->integers.publishClaimed(idx, ret);
+    return ret;
+}
+
+void VmResolveCache::trim(uint32_t minHits) {
+    JNIEnv *env = VM_CONTEXT::env;
+    uint32_t dropped = 0;
+    // the table is built again from the refs kept.
+    this->refs.clear();
+    auto dropString = [env, &dropped](VmStringEntry *entry) {
+        (*env).DeleteGlobalRef(entry->str);
+        delete entry;
+        dropped++;
+    };
+    auto keepString = [this](VmStringEntry *entry) {
+        this->refs.insert(entry->str, (uintptr_t) entry);
+    };
+    auto dropClass = [env, &dropped](jclass clazz) {
+        (*env).DeleteGlobalRef(clazz);
+        dropped++;
+    };
+    auto keepClass = [this](jclass clazz) {
+        this->refs.insert(clazz, kRefClass);
+    };
+    auto dropId = [](const void *) {};
+    const u4 count = this->dexCacheCount.load(std::memory_order_acquire);
+    for (u4 i = 0; i < count; i++) {
+        VmDexCache *dexCache = this->dexCaches[i].load(std::memory_order_relaxed);
+        dexCache->strings.trim(minHits, dropString, keepString);
+        dexCache->classes.trim(minHits, dropClass, keepClass);
+        dexCache->elementClasses.trim(minHits, dropClass, keepClass);
+        dexCache->methods.trim(minHits, dropId, dropId);
+        dexCache->fields.trim(minHits, dropId, dropId);
+    }
+    // the Integer cache of java is never trimmed either.
+    for (u4 i = 0; i < this->integers.size(); i++) {
+        jobject box = this->integers.find(i);
+        if (box != nullptr) {
+            this->refs.insert(box, (uintptr_t) (u4) (i + VM_INTEGER_CACHE_LOW) << 32u | kRefInteger);
+        }
+    }
+    LOG_D("resolve cache trim, global refs dropped: %u", dropped);
+}
+
+VmResolveCache::~VmResolveCache() {
+    JNIEnv *env = VM_CONTEXT::env;
+    auto deleteRef = [env](jobject ref) {
+        (*env).DeleteGlobalRef(ref);
+    };
+    const u4 count = this->dexCacheCount.load(std::memory_order_acquire);
+    for (u4 i = 0; i < count; i++) {
+        VmDexCache *dexCache = this->dexCaches[i].load(std::memory_order_relaxed);
+        dexCache->strings.forEach([env](VmStringEntry *entry) {
+            (*env).DeleteGlobalRef(entry->str);
+            delete entry;
+        });
+        dexCache->classes.forEach(deleteRef);
+        dexCache->elementClasses.forEach(deleteRef);
+        delete dexCache;
+    }
+    this->integers.forEach(deleteRef);
+}
+
+void VmResolveCache::decodeMUTF8(const char *data, std::vector<jchar> &chars) {
+    // modified utf-8: no 4-byte form, supplementary chars are surrogate pairs.
+    const auto *ptr = (const u1 *) data;
+    while (*ptr != '\0') {
+        u1 one = *(ptr++);
+        if ((one & 0x80u) == 0) {
+            chars.push_back(one);
+        } else if ((one & 0x20u) == 0) {
+            chars.push_back(((one & 0x1fu) << 6u) | (*(ptr++) & 0x3fu));
+        } else {
+            u1 two = *(ptr++);
+            chars.push_back(((one & 0x0fu) << 12u) | ((two & 0x3fu) << 6u) | (*(ptr++) & 0x3fu));
+        }
+    }
+}
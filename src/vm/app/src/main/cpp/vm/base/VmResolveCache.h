@@ -0,0 +1,158 @@
+//
+// Created by 陈泽伦 on 1/5/21.
+//
+
+#ifndef VM_VMRESOLVECACHE_H
+#define VM_VMRESOLVECACHE_H
+
+#include <jni.h>
+#include <cassert>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "../../common/AndroidSystem.h"
+#include "VmDexCache.h"
+
+// java.lang.Integer's cache of valueOf.
+#define VM_INTEGER_CACHE_LOW   (-128)
+#define VM_INTEGER_CACHE_HIGH  127
+
+struct VmStringEntry {
+    // interned java string, global ref.
+    jstring str;
+    // utf-16 content, used by the String intrinsics.
+    std::vector<jchar> chars;
+};
+
+/**
+ * open addressing from a global ref to what it was cached as, readers take
+ * no lock. It only grows between two trims, and a ref which finds no free
+ * slot is not recorded: it is then taken for a local ref, which is safe.
+ */
+class VmRefTable {
+private:
+    struct Slot {
+        std::atomic<jobject> ref;
+        // 0 until the value is published.
+        std::atomic<uintptr_t> val;
+    };
+
+    Slot *slots;
+    u4 mask;
+
+public:
+    // count is a power of 2.
+    explicit VmRefTable(u4 count);
+
+    VmRefTable(const VmRefTable &) = delete;
+
+    VmRefTable &operator=(const VmRefTable &) = delete;
+
+    ~VmRefTable();
+
+    inline uintptr_t find(jobject ref) const {
+        for (u4 i = VmRefTable::hash(ref), n = 0; n <= this->mask; i++, n++) {
+            const Slot &slot = this->slots[i & this->mask];
+            jobject key = slot.ref.load(std::memory_order_acquire);
+            if (key == ref) {
+                return slot.val.load(std::memory_order_acquire);
+            }
+            if (key == nullptr) {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    // val != 0, false if the table is full.
+    bool insert(jobject ref, uintptr_t val);
+
+    // only while no thread runs the vm.
+    void clear();
+
+private:
+    static inline u4 hash(jobject ref) {
+        return (u4) (((uintptr_t) ref * 0x9e3779b97f4a7c15ULL) >> 32u);
+    }
+};
+
+/**
+ * resolved dex constants which outlive every jni local frame, shared by the
+ * threads running the vm. Resolving reads one slot of the VmDexCache without
+ * a lock, a global ref is made once per slot by the thread claiming it.
+ */
+class VmResolveCache {
+private:
+    // only grows, a reader scans the first dexCacheCount ones.
+    std::atomic<VmDexCache *> dexCaches[VM_CONFIG::VM_RESOLVE_CACHE_DEX_FILES]{};
+    std::atomic<u4> dexCacheCount{0};
+    // taken to add a dex file, never by a reader.
+    std::mutex dexLock;
+
+    VmSlotArray<jobject> integers{VM_INTEGER_CACHE_HIGH - VM_INTEGER_CACHE_LOW + 1};
+
+    // every global ref above.
+    VmRefTable refs{VM_CONFIG::VM_RESOLVE_CACHE_REF_SLOTS};
+
+    std::atomic<jmethodID> mIntern{nullptr};
+
+    // the values of refs, a VmStringEntry * or one of the tags below.
+    static const uintptr_t kRefClass = 1u;
+    // the value of the Integer is in the high 32 bits.
+    static const uintptr_t kRefInteger = 2u;
+    static const uintptr_t kRefTagMask = 3u;
+
+public:
+    // the dex file mapped at begin, made on the first call.
+    VmDexCache *getDexCache(const u1 *begin);
+
+    jstring resolveString(VmDexCache *dexCache, u4 idx);
+
+    inline const VmStringEntry *findString(jobject str) const {
+        uintptr_t val = this->refs.find(str);
+        return val == 0 || (val & kRefTagMask) != 0 ? nullptr : (const VmStringEntry *) val;
+    }
+
+    /**
+     * publish the class resolved for idx, clazz is a local ref.
+     * @return the global ref of the slot, or clazz while another thread
+     * is still making it.
+     */
+    jclass cacheClass(VmSlotArray<jclass> &slots, u4 idx, jclass clazz);
+
+    inline jobject findInteger(jint value) const {
+        assert(VM_INTEGER_CACHE_LOW <= value && value <= VM_INTEGER_CACHE_HIGH);
+        return this->integers.find(value - VM_INTEGER_CACHE_LOW);
+    }
+
+    jobject cacheInteger(jint value, jobject box);
+
+    inline bool findIntegerValue(jobject box, jint &value) const {
+        uintptr_t val = this->refs.find(box);
+        if ((val & kRefTagMask) != kRefInteger) {
+            return false;
+        }
+        value = (jint) (u4) (val >> 32u);
+        return true;
+    }
+
+    inline bool isCachedRef(jobject ref) const {
+        return this->refs.find(ref) != 0;
+    }
+
+    /**
+     * drop the strings, classes, methods and fields resolved fewer than
+     * minHits times since the last trim, and start counting again. Only
+     * while no thread runs the vm, the dropped global refs may be in its
+     * registers and the readers take no lock.
+     */
+    void trim(uint32_t minHits);
+
+    ~VmResolveCache();
+
+private:
+    static void decodeMUTF8(const char *data, std::vector<jchar> &chars);
+};
+
+
+#endif //VM_VMRESOLVECACHE_H
@@ -3,7 +3,10 @@
 //
 
 #include "VmStack.h"
+#include "VmRandom.h"
 #include <cstdlib>
+#include <cerrno>
+#include <sys/mman.h>
 
 void
 VmRandomStack::push(
@@ -60,86 +63,253 @@ VmFrame *VmRandomStack::newFrame(
 }
 
 void VmRandomStack::deleteFrame(VmFrame *frame) {
-    this->topFrame->vmc.curException = frame->pre->vmc.curException;
+    // throw the uncaught exception to the caller.
+    if (this->topFrame != nullptr) {
+        this->topFrame->vmc.curException = frame->vmc.curException;
+    }
     frame->pre = nullptr;
     frame->vmc.release();
     this->freeFrame(frame);
 }
 
 VmRandomStack::VmRandomStack(uint16_t freePageSize, VmMemory *memoryManager) {
+    static_assert(sizeof(VmStackPage) <= 64u, "too big of VmStackPage.");
     this->memoryManager = memoryManager;
     assert(this->memoryManager != nullptr);
     this->freePageCount = freePageSize;
+    this->emptyPageCount = 0;
     this->topFrame = nullptr;
     for (int i = 0; i < freePageSize; ++i) {
-        this->freeMem.push_back(this->memoryManager->malloc());
-        this->freePages.push_back(0UL);
+        this->newPage();
     }
 }
 
 VmRandomStack::~VmRandomStack() {
-    for (auto it:this->fullPages) {
-        this->memoryManager->free(it);
-    }
-    for (auto it:this->freeMem) {
+    for (auto it:this->pages) {
         this->memoryManager->free(it);
     }
 }
 
 VmFrame *VmRandomStack::mallocFrame() {
-    uint64_t r;
-    uint32_t d;
-    uint32_t offset;
-    uint32_t num;
-    do {
-        num = random() % (this->freePages.size() * this->DATA_COUNT_IN_PAGE);
-        offset = num & 0x3fU;
-        r = 1UL << offset;
-        d = num >> 6u;
-    } while (this->freePages[d] & r);
-    LOG_D_VM("memory: %p, num: %u", this->freeMem[d], num);
-    this->freePages[d] |= r;
-    uint8_t *ret = this->freeMem[d];
-    if (this->freePages[d] == (~0x0UL)) {
-        fullPages.insert(this->freeMem[d]);
-        LOG_D_VM("add a full page: %p", this->freeMem[d]);
-        if (freePages.size() == freePageCount) {
-            this->freeMem[d] = this->memoryManager->malloc();
-            this->freePages[d] = 0UL;
+    VmStackPage *page;
+    if (this->partialPages.empty()) {
+        page = this->newPage();
+    } else {
+        page = this->partialPages[VmRandom::below(this->partialPages.size())];
+    }
+    // a random free slot: rotate the free bits by a random offset.
+    const uint32_t rot = VmRandom::next() & 0x3fu;
+    const uint64_t freeSlots = ~page->used;
+    const uint64_t rotated = (freeSlots >> rot) | (freeSlots << ((64u - rot) & 0x3fu));
+    const uint32_t slot = (rot + __builtin_ctzll(rotated)) & 0x3fu;
+    if (page->used == 1u) {
+        this->emptyPageCount--;
+    }
+    page->used |= 1UL << slot;
+    this->countPush();
+    if (page->used == ~0UL) {
+        this->removePartialPage(page);
+        LOG_D_VM("add a full page: %p", page);
+    }
+    LOG_D_VM("memory: %p, slot: %u", page, slot);
+    return (VmFrame *) ((uint8_t *) page + (slot << 6u));
+}
+
+void VmRandomStack::freeFrame(VmFrame *frame) {
+    auto *page = (VmStackPage *) ((uint64_t) frame & (~0xfffUL));
+    const uint32_t slot = ((uint64_t) frame & 0xfffu) >> 6u;
+    assert(slot != 0 && (page->used >> slot & 1u));
+    if (page->partialIndex == kNotPartial) {
+        page->partialIndex = this->partialPages.size();
+        this->partialPages.push_back(page);
+    }
+    page->used &= ~(1UL << slot);
+    this->countPop();
+    LOG_D_VM("freeCache a frame: %p, slot: %u", page, slot);
+    if (page->used == 1u) {
+        if (this->emptyPageCount < this->freePageCount) {
+            this->emptyPageCount++;
         } else {
-            this->freePages.erase(this->freePages.begin() + d);
-            this->freeMem.erase(this->freeMem.begin() + d);
+            this->deletePage(page);
         }
     }
-    return (VmFrame *) (ret + (offset << 6u));
 }
 
-void VmRandomStack::freeFrame(VmFrame *frame) {
-    uint32_t offset = ((uint64_t) frame & 0x3fu);
-    uint64_t r = 1UL << offset;
-    auto *f = (uint8_t *) frame;
-    for (int i = 0; i < this->freePages.size(); ++i) {
-        uint8_t *b = this->freeMem[i];
-        if (b <= f && f < b + 0x1000u) {
-            this->freePages[i] &= ~r;
-            LOG_D_VM("freeCache a frame: %p, off: %u, r: 0x%016lu", this->freeMem[i], offset, r);
-            if (this->freePages[i] == 0u &&
-                this->freePages.size() > this->freePageCount) {
-                this->memoryManager->free(this->freeMem[i]);
-                this->freePages.erase(this->freePages.begin() + i);
-                this->freeMem.erase(this->freeMem.begin() + i);
-            }
-            return;
+VmStackPage *VmRandomStack::newPage() {
+    auto *page = (VmStackPage *) this->memoryManager->malloc();
+    page->used = 1u;
+    page->pageIndex = this->pages.size();
+    page->partialIndex = this->partialPages.size();
+    this->pages.push_back(page);
+    this->partialPages.push_back(page);
+    this->emptyPageCount++;
+    return page;
+}
+
+void VmRandomStack::deletePage(VmStackPage *page) {
+    this->removePartialPage(page);
+    VmStackPage *last = this->pages.back();
+    last->pageIndex = page->pageIndex;
+    this->pages[page->pageIndex] = last;
+    this->pages.pop_back();
+    this->memoryManager->free(page);
+}
+
+void VmRandomStack::removePartialPage(VmStackPage *page) {
+    VmStackPage *last = this->partialPages.back();
+    last->partialIndex = page->partialIndex;
+    this->partialPages[page->partialIndex] = last;
+    this->partialPages.pop_back();
+    page->partialIndex = kNotPartial;
+}
+
+VmStackStats VmRandomStack::getStackStats() const {
+    VmStackStats stats{};
+    stats.frames = this->frameCount;
+    stats.maxFrames = this->maxFrameCount;
+    stats.pages = this->pages.size();
+    stats.fullPages = this->pages.size() - this->partialPages.size();
+    stats.emptyPages = this->emptyPageCount;
+    return stats;
+}
+
+void VmRandomStack::trimStack() {
+    for (uint32_t i = this->pages.size(); i > 0; i--) {
+        VmStackPage *page = this->pages[i - 1];
+        if (page->used == 1u) {
+            this->deletePage(page);
+        }
+    }
+    this->emptyPageCount = 0;
+}
+
+static const uint32_t kFrameSize = 64u;
+static const uint32_t kMethodSize = (sizeof(VmMethod) + 7u) & ~7u;
+
+VmLinearStack::VmLinearStack(uint64_t segmentSize) {
+    static_assert(sizeof(VmFrame) <= kFrameSize, "too big of VmFrame.");
+    assert((segmentSize & 0xfffu) == 0);
+    this->segmentSize = segmentSize;
+    this->segmentIndex = 0;
+    this->top = nullptr;
+    this->limit = nullptr;
+    this->topFrame = nullptr;
+    this->nextSegment(segmentSize);
+}
+
+VmLinearStack::~VmLinearStack() {
+    for (auto &it : this->segments) {
+        munmap(it.base, it.limit - it.base);
+    }
+}
+
+void VmLinearStack::push(jobject caller, jmethodID method, jvalue *pResult, va_list param) {
+    VmFrame *frame = this->newFrame(method, pResult);
+    frame->vmc.pushParams(caller, param);
+}
+
+void VmLinearStack::pushWithoutParams(jmethodID method, jvalue *pResult) {
+    this->newFrame(method, pResult);
+}
+
+void VmLinearStack::pop() {
+    assert(this->topFrame != nullptr);
+    VmFrame *frame = this->topFrame;
+    LOG_D("exit  vm: %s", frame->vmc.method->name);
+    this->topFrame = frame->pre;
+    // throw the uncaught exception to the caller.
+    if (this->topFrame != nullptr) {
+        this->topFrame->vmc.curException = frame->vmc.curException;
+    }
+    this->countPop();
+    this->top = (uint8_t *) frame;
+    if (this->top == this->segments[this->segmentIndex].base && this->segmentIndex > 0) {
+        // the first frame of the segment, back to the previous one.
+        this->segmentIndex--;
+        this->top = this->segments[this->segmentIndex].top;
+        this->limit = this->segments[this->segmentIndex].limit;
+    }
+}
+
+VmFrame *VmLinearStack::newFrame(jmethodID method, jvalue *pResult) {
+    // size the whole frame first, a segment never ends up without a frame.
+    VmMethod resetMethod{};
+    resetMethod.reset(method, true);
+    const uint64_t size = kFrameSize + kMethodSize +
+            VmMethodContext::regBufferCount(resetMethod.code->registersSize) * sizeof(u4);
+    if (this->top + size > this->limit) {
+        this->nextSegment(size);
+    }
+    auto *frame = (VmFrame *) this->top;
+    auto *pMethod = (VmMethod *) (this->top + kFrameSize);
+    *pMethod = resetMethod;
+    auto *regs = (u4 *) (this->top + kFrameSize + kMethodSize);
+    frame->vmc.bind(pMethod, regs, pResult);
+    LOG_D("enter vm: %s", frame->vmc.method->name);
+    frame->pre = this->topFrame;
+    this->topFrame = frame;
+    this->countPush();
+    this->top = (uint8_t *) (((uint64_t) this->top + size + kFrameSize - 1u) &
+                             ~(uint64_t) (kFrameSize - 1u));
+    return frame;
+}
+
+void VmLinearStack::nextSegment(uint64_t size) {
+    if (!this->segments.empty()) {
+        this->segments[this->segmentIndex].top = this->top;
+        this->segmentIndex++;
+    }
+    if (this->segmentIndex < this->segments.size() &&
+        (uint64_t) (this->segments[this->segmentIndex].limit -
+                    this->segments[this->segmentIndex].base) < size) {
+        // too small for this frame, map a bigger one.
+        VmStackSegment &old = this->segments[this->segmentIndex];
+        munmap(old.base, old.limit - old.base);
+        this->segments.erase(this->segments.begin() + this->segmentIndex);
+    }
+    if (this->segmentIndex == this->segments.size()) {
+        const uint64_t mapSize = MAX(this->segmentSize, (size + 0xfffu) & ~0xfffUL);
+        auto *base = (uint8_t *) mmap(nullptr,
+                                      mapSize,
+                                      (uint) PROT_READ | (uint) PROT_WRITE,
+                                      (uint) MAP_PRIVATE | (uint) MAP_ANONYMOUS,
+                                      -1, 0);
+        if (base == MAP_FAILED) {
+            LOG_E("VmLinearStack mmap segment fail.");
+            LOG_E("error: %s", strerror(errno));
+            throw VMException("VmLinearStack mmap segment fail.");
         }
+        LOG_D_VM("linear stack segment: %u, size: %lu, base: %p",
+                 this->segmentIndex, mapSize, base);
+        this->segments.insert(this->segments.begin() + this->segmentIndex,
+                              {base, base + mapSize, base});
     }
+    this->top = this->segments[this->segmentIndex].base;
+    this->limit = this->segments[this->segmentIndex].limit;
+}
+
+VmStackStats VmLinearStack::getStackStats() const {
+    VmStackStats stats{};
+    stats.frames = this->frameCount;
+    stats.maxFrames = this->maxFrameCount;
+    for (uint32_t i = 0; i < this->segments.size(); i++) {
+        const VmStackSegment &it = this->segments[i];
+        const uint32_t pages = (it.limit - it.base) >> 12u;
+        stats.pages += pages;
+        if (i < this->segmentIndex) {
+            stats.fullPages += pages;
+        } else if (i == this->segmentIndex) {
+            stats.fullPages += (this->top - it.base) >> 12u;
+        }
+    }
+    stats.emptyPages = stats.pages - stats.fullPages;
+    return stats;
+}
 
-    auto *t = (uint8_t *) ((uint64_t) frame & (~0xfffUL));
-    if (this->fullPages.find(t) == this->fullPages.end()) {
-        LOG_E("can't find the memory: %p", frame);
-        throw VMException("can't find the memory");
+void VmLinearStack::trimStack() {
+    // the segments above the current one are unused.
+    for (uint32_t i = this->segmentIndex + 1; i < this->segments.size(); i++) {
+        munmap(this->segments[i].base, this->segments[i].limit - this->segments[i].base);
     }
-    this->fullPages.erase(t);
-    this->freeMem.push_back(t);
-    this->freePages.push_back(0xffffffffffffffffUL & (~r));
-    LOG_D_VM("freeCache a frame from full pages.");
+    this->segments.resize(this->segmentIndex + 1);
 }
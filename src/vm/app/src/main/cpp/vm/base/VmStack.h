@@ -11,18 +11,42 @@
 #include "../../common/VmConstant.h"
 
 #include <vector>
-#include <set>
 
 struct VmFrame {
     VmMethodContext vmc;
     VmFrame *pre = nullptr;
 };
 
+struct VmStackStats {
+    uint32_t frames;
+    // most frames alive at once since the vm started.
+    uint32_t maxFrames;
+    // pages held by the stack. For the linear stack the full pages are the
+    // ones below the top and the empty ones the mapped rest.
+    uint32_t pages;
+    uint32_t fullPages;
+    uint32_t emptyPages;
+};
+
 class VmStack {
 protected:
     // call stack
     VmFrame *topFrame;
 
+    uint32_t frameCount = 0;
+    uint32_t maxFrameCount = 0;
+
+    inline void countPush() {
+        if (++this->frameCount > this->maxFrameCount) {
+            this->maxFrameCount = this->frameCount;
+        }
+    }
+
+    inline void countPop() {
+        assert(this->frameCount > 0);
+        this->frameCount--;
+    }
+
 public:
     virtual void push(jobject caller, jmethodID method, jvalue *pResult, va_list param) = 0;
 
@@ -34,22 +58,41 @@ public:
         return this->topFrame;
     }
 
+    virtual VmStackStats getStackStats() const = 0;
+
+    // give back the memory kept for the next frames.
+    virtual void trimStack() = 0;
+
     virtual ~VmStack(){};
 };
 
+/**
+ * header of a stack page, it takes the first of the 64 slots.
+ * the page of a frame is found by masking its address.
+ */
+struct VmStackPage {
+    // bit i: slot i is used, the header's bit is always set.
+    uint64_t used;
+    // index in VmRandomStack::pages.
+    uint32_t pageIndex;
+    // index in VmRandomStack::partialPages, kNotPartial if the page is full.
+    uint32_t partialIndex;
+};
+
 class VmRandomStack : public VmStack {
 private:
+    static const uint32_t kNotPartial = UINT32_MAX;
+
     // memory
     VmMemory *memoryManager;
 
     // page
+    // empty pages kept for the next frames.
     uint32_t freePageCount;
-    std::vector<uint64_t> freePages;
-    std::vector<uint8_t *> freeMem;
-    std::set<uint8_t *> fullPages;
-
-    // PAGE_SIZE = 4KB
-    const uint16_t DATA_COUNT_IN_PAGE = 64u;
+    uint32_t emptyPageCount;
+    std::vector<VmStackPage *> pages;
+    // pages with a free slot, new frames go to a random one of them.
+    std::vector<VmStackPage *> partialPages;
 
 public:
     VmRandomStack(uint16_t freePageSize, VmMemory *memoryManager);
@@ -62,6 +105,10 @@ public:
 
     void pop() override;
 
+    VmStackStats getStackStats() const override;
+
+    void trimStack() override;
+
 private:
     VmFrame *newFrame(jobject caller, jmethodID method, jvalue *pResult, va_list param);
 
@@ -70,6 +117,55 @@ private:
     VmFrame *mallocFrame();
 
     void freeFrame(VmFrame *frame);
+
+    VmStackPage *newPage();
+
+    void deletePage(VmStackPage *page);
+
+    void removePartialPage(VmStackPage *page);
+};
+
+/**
+ * frames bumped in one region, every frame is laid out as
+ * VmFrame | VmMethod | registers | object bits, 64 bytes aligned.
+ */
+struct VmStackSegment {
+    uint8_t *base;
+    uint8_t *limit;
+    // top of the segment when the stack went on to the next one.
+    uint8_t *top;
+};
+
+class VmLinearStack : public VmStack {
+private:
+    uint64_t segmentSize;
+    // mapped on demand and kept for the next deep call.
+    std::vector<VmStackSegment> segments;
+    uint32_t segmentIndex;
+    // the next frame starts here.
+    uint8_t *top;
+    uint8_t *limit;
+
+public:
+    explicit VmLinearStack(uint64_t segmentSize);
+
+    ~VmLinearStack();
+
+    void push(jobject caller, jmethodID method, jvalue *pResult, va_list param) override;
+
+    void pushWithoutParams(jmethodID method, jvalue *pResult) override;
+
+    void pop() override;
+
+    VmStackStats getStackStats() const override;
+
+    void trimStack() override;
+
+private:
+    VmFrame *newFrame(jmethodID method, jvalue *pResult);
+
+    // move the top to the next segment, which holds at least size bytes.
+    void nextSegment(uint64_t size);
 };
 
 
@@ -7,6 +7,7 @@
 #include "../JavaException.h"
 #include "../Vm.h"
 #include "../base/VmStack.h"
+#include "VmFusion.h"
 #include <cmath>
 
 static const char kSpacing[] = "            ";
@@ -260,104 +261,135 @@ void StandardInterpret::filledNewArray(VmMethodContext *vmc, bool range) {
     JNIEnv *env = VM_CONTEXT::env;
     vmc->tmp->val_1.u4 = vmc->fetch(1);
     vmc->tmp->dst = vmc->fetch(2);
+    // registers of the elements, at most 255 of them.
+    u2 regs[256];
     if (range) {
         vmc->tmp->src1 = vmc->inst_AA();
         LOG_D_VM("|filled-new-array-range args=%u @%u {regs=v%u-v%u}",
                  vmc->tmp->src1, vmc->tmp->val_1.u4, vmc->tmp->dst,
                  vmc->tmp->dst + vmc->tmp->src1 - 1);
+        for (int i = 0; i < vmc->tmp->src1; i++) {
+            regs[i] = vmc->tmp->dst + i;
+        }
     } else {
         vmc->tmp->src1 = vmc->inst_B();
         LOG_D_VM("|filled-new-array args=%u @%u {regs=%u %u}",
                  vmc->tmp->src1, vmc->tmp->val_1.u4, vmc->tmp->dst, vmc->inst_A());
+        assert(vmc->tmp->src1 <= 5);
+        // no break
+        switch (vmc->tmp->src1) {
+            case 5:
+                regs[4] = vmc->inst_A() & 0x0fu;
+            case 4:
+                regs[3] = vmc->tmp->dst >> 12u;
+            case 3:
+                regs[2] = (vmc->tmp->dst & 0x0f00u) >> 8u;
+            case 2:
+                regs[1] = (vmc->tmp->dst & 0x00f0u) >> 4u;
+            case 1:
+                regs[0] = vmc->tmp->dst & 0x000fu;
+        }
     }
 
-    vmc->tmp->val_1.lc = vmc->method->resolveClass(vmc->tmp->val_1.u4);
-    if (vmc->tmp->val_1.lc == nullptr) {
-        JavaException::throwJavaException(vmc);
-        return;
-    }
-    const std::string desc = VmMethod::getClassDescriptorByJClass(vmc->tmp->val_1.lc);
-    assert(desc.size() >= 2);
+    const char *desc = vmc->method->dexFile->dexStringByTypeIdx(vmc->tmp->val_1.u4);
     assert(desc[0] == '[');
-    LOG_D_VM("+++ filled-new-array type is '%s'", desc.data());
+    LOG_D_VM("+++ filled-new-array type is '%s'", desc);
 
+    const u4 count = vmc->tmp->src1;
     const char typeCh = desc[1];
-    if (typeCh == 'D' || typeCh == 'J') {
-        /* category 2 primitives not allowed */
-        LOG_E("category 2 primitives('D' or 'J') not allowed");
-        JavaException::throwRuntimeException(vmc, "bad filled array req");
-        return;
-    } else if (typeCh != 'L' && typeCh != '[' && typeCh != 'I') {
-        LOG_E("non-int primitives not implemented");
-        JavaException::throwInternalError(
-                vmc, "filled-new-array not implemented for anything but 'int'");
-        return;
-    }
-
-    if (typeCh == 'L' || typeCh == '[') {
-        jclass elementClazz;
-        if (typeCh == 'L') {
-            assert(desc.size() > 3);
-            elementClazz = (*env).FindClass(
-                    desc.substr(2, desc.size() - 1).data());
-        } else {
-            assert(desc.size() > 2);
-            elementClazz = (*env).FindClass(
-                    desc.substr(1, desc.size() - 1).data());
+    switch (typeCh) {
+        case 'L':
+        case '[': {
+            jclass elementClazz = vmc->method->resolveElementClass(vmc->tmp->val_1.u4);
+            if (elementClazz == nullptr) {
+                JavaException::throwJavaException(vmc);
+                return;
+            }
+            // the array starts out filled with the first element,
+            // only the elements differing from it need a store.
+            jobject first = count == 0 ? nullptr : vmc->getRegisterAsObject(regs[0]);
+            vmc->tmp->val_1.l = (*env).NewObjectArray(count, elementClazz, first);
+            if (vmc->tmp->val_1.l == nullptr) {
+                break;
+            }
+            for (u4 i = 1; i < count; i++) {
+                jobject element = vmc->getRegisterAsObject(regs[i]);
+                if (element != first) {
+                    (*env).SetObjectArrayElement(vmc->tmp->val_1.lla, i, element);
+                }
+            }
+            break;
         }
-        auto *contents = new jobject[vmc->tmp->src1]();
-        if (range) {
-            for (int i = 0; i < vmc->tmp->src1; i++) {
-                contents[i] = vmc->getRegisterAsObject(vmc->tmp->dst + i);
+        case 'I':
+        case 'F': {
+            // a float register holds the raw bits, so both share one buffer.
+            jint contents[256];
+            for (u4 i = 0; i < count; i++) {
+                contents[i] = vmc->getRegisterInt(regs[i]);
             }
-        } else {
-            assert(vmc->tmp->src1 <= 5);
-            // no break
-            switch (vmc->tmp->src1) {
-                case 5:
-                    contents[4] = vmc->getRegisterAsObject(vmc->inst_A() & 0x0fu);
-                case 4:
-                    contents[3] = vmc->getRegisterAsObject(vmc->tmp->dst >> 12u);
-                case 3:
-                    contents[2] = vmc->getRegisterAsObject((vmc->tmp->dst & 0x0f00u) >> 8u);
-                case 2:
-                    contents[1] = vmc->getRegisterAsObject((vmc->tmp->dst & 0x00f0u) >> 4u);
-                case 1:
-                    contents[0] = vmc->getRegisterAsObject((vmc->tmp->dst & 0x000fu));
+            if (typeCh == 'I') {
+                vmc->tmp->val_1.l = (*env).NewIntArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetIntArrayRegion(vmc->tmp->val_1.lia, 0, count, contents);
+                }
+            } else {
+                vmc->tmp->val_1.l = (*env).NewFloatArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetFloatArrayRegion(vmc->tmp->val_1.lfa, 0, count,
+                                               (jfloat *) contents);
+                }
             }
+            break;
         }
-
-        vmc->tmp->val_1.l = (*env).NewObjectArray(
-                vmc->tmp->src1, elementClazz, nullptr);
-        for (int i = 0; i < vmc->tmp->src1; i++) {
-            (*env).SetObjectArrayElement(vmc->tmp->val_1.lla, i, contents[i]);
+        case 'C':
+        case 'S': {
+            jshort contents[256];
+            for (u4 i = 0; i < count; i++) {
+                contents[i] = (jshort) vmc->getRegisterInt(regs[i]);
+            }
+            if (typeCh == 'C') {
+                vmc->tmp->val_1.l = (*env).NewCharArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetCharArrayRegion(vmc->tmp->val_1.lca, 0, count,
+                                              (jchar *) contents);
+                }
+            } else {
+                vmc->tmp->val_1.l = (*env).NewShortArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetShortArrayRegion(vmc->tmp->val_1.lsa, 0, count, contents);
+                }
+            }
+            break;
         }
-//        (*env).DeleteLocalRef(elementClazz);
-        delete[] contents;
-    } else {
-        u4 *contents = new u4[vmc->tmp->src1]();
-        if (range) {
-            for (int i = 0; i < vmc->tmp->src1; ++i) {
-                contents[i] = vmc->getRegister(vmc->tmp->dst + i);
+        case 'B':
+        case 'Z': {
+            jbyte contents[256];
+            for (u4 i = 0; i < count; i++) {
+                contents[i] = (jbyte) vmc->getRegisterInt(regs[i]);
             }
-        } else {
-            assert(vmc->tmp->src1 <= 5);
-            // no break
-            switch (vmc->tmp->src1) {
-                case 5:
-                    contents[4] = vmc->getRegister(vmc->inst_A() & 0x0fu);
-                case 4:
-                    contents[3] = vmc->getRegister(vmc->tmp->dst >> 12u);
-                case 3:
-                    contents[2] = vmc->getRegister((vmc->tmp->dst & 0x0f00u) >> 8u);
-                case 2:
-                    contents[1] = vmc->getRegister((vmc->tmp->dst & 0x00f0u) >> 4u);
-                case 1:
-                    contents[0] = vmc->getRegister((vmc->tmp->dst & 0x000fu));
+            if (typeCh == 'B') {
+                vmc->tmp->val_1.l = (*env).NewByteArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetByteArrayRegion(vmc->tmp->val_1.lba, 0, count, contents);
+                }
+            } else {
+                vmc->tmp->val_1.l = (*env).NewBooleanArray(count);
+                if (vmc->tmp->val_1.l != nullptr) {
+                    (*env).SetBooleanArrayRegion(vmc->tmp->val_1.lza, 0, count,
+                                                 (jboolean *) contents);
+                }
             }
+            break;
         }
-        vmc->tmp->val_1.l = (*env).NewIntArray(vmc->tmp->src1);
-        (*env).SetIntArrayRegion(vmc->tmp->val_1.lia, 0, vmc->tmp->src1, (jint *) contents);
+        default:
+            /* category 2 primitives not allowed */
+            LOG_E("category 2 primitives('D' or 'J') not allowed");
+            JavaException::throwRuntimeException(vmc, "bad filled array req");
+            return;
+    }
+    if (vmc->tmp->val_1.l == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return;
     }
 
     vmc->retVal->l = vmc->tmp->val_1.l;
@@ -528,7 +560,7 @@ void ST_CH_Move_Object::run(VmMethodContext *vmc) {
     LOG_D_VM("|move%s v%u,v%u %s(v%u=%p)", "-object",
              vmc->tmp->dst, vmc->tmp->src1, kSpacing, vmc->tmp->dst,
              vmc->getRegisterAsObject(vmc->tmp->src1));
-    vmc->setRegisterAsObject(vmc->tmp->dst, vmc->getRegisterAsObject(vmc->tmp->src1));
+    vmc->moveRegisterObject(vmc->tmp->dst, vmc, vmc->tmp->src1);
     vmc->pc_off(1);
 }
 
@@ -538,7 +570,7 @@ void ST_CH_Move_Object_From16::run(VmMethodContext *vmc) {
     LOG_D_VM("|move%s/from16 v%u,v%u %s(v%u=%p)",
              "-object", vmc->tmp->dst, vmc->tmp->src1, kSpacing, vmc->tmp->dst,
              vmc->getRegisterAsObject(vmc->tmp->src1));
-    vmc->setRegisterAsObject(vmc->tmp->dst, vmc->getRegisterAsObject(vmc->tmp->src1));
+    vmc->moveRegisterObject(vmc->tmp->dst, vmc, vmc->tmp->src1);
     vmc->pc_off(2);
 }
 
@@ -548,7 +580,7 @@ void ST_CH_Move_Object16::run(VmMethodContext *vmc) {
     LOG_D_VM("|move%s/16 v%u,v%u %s(v%u=%p)",
              "-object", vmc->tmp->dst, vmc->tmp->src1, kSpacing, vmc->tmp->dst,
              vmc->getRegisterAsObject(vmc->tmp->src1));
-    vmc->setRegisterAsObject(vmc->tmp->dst, vmc->getRegisterAsObject(vmc->tmp->src1));
+    vmc->moveRegisterObject(vmc->tmp->dst, vmc, vmc->tmp->src1);
     vmc->pc_off(3);
 }
 
@@ -688,7 +720,10 @@ void ST_CH_Const_String::run(VmMethodContext *vmc) {
     vmc->tmp->val_1.u4 = vmc->fetch(1);
     LOG_D_VM("|const-string v%u string@%u", vmc->tmp->dst, vmc->tmp->val_1.u4);
     vmc->tmp->val_1.l = vmc->method->resolveString(vmc->tmp->val_1.u4);
-    assert(vmc->tmp->val_1.l != nullptr);
+    if (vmc->tmp->val_1.l == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return;
+    }
     vmc->setRegisterAsObject(vmc->tmp->dst, vmc->tmp->val_1.l);
     vmc->pc_off(2);
 }
@@ -699,7 +734,10 @@ void ST_CH_Const_String_Jumbo::run(VmMethodContext *vmc) {
     vmc->tmp->val_1.u4 |= (u4) vmc->fetch(2) << 16u;
     LOG_D_VM("|const-string/jumbo v%u string@%u", vmc->tmp->dst, vmc->tmp->val_1.u4);
     vmc->tmp->val_1.l = vmc->method->resolveString(vmc->tmp->val_1.u4);
-    assert(vmc->tmp->val_1.l != nullptr);
+    if (vmc->tmp->val_1.l == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return;
+    }
     vmc->setRegisterAsObject(vmc->tmp->dst, vmc->tmp->val_1.l);
     vmc->pc_off(3);
 }
@@ -725,6 +763,8 @@ void ST_CH_Monitor_Enter::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.l)) {
         return;
     }
+    vmc->tmp->epoch++;
+    VM_CONTEXT::vm->getArrayCache()->flush();
     (*VM_CONTEXT::env).MonitorEnter(vmc->tmp->val_1.l);
     vmc->pc_off(1);
 }
@@ -746,6 +786,8 @@ void ST_CH_Monitor_Exit::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.l)) {
         return;
     }
+    vmc->tmp->epoch++;
+    VM_CONTEXT::vm->getArrayCache()->flush();
     if (!(*VM_CONTEXT::env).MonitorExit(vmc->tmp->val_1.l)) {
         JavaException::throwJavaException(vmc);
         return;
@@ -805,12 +847,17 @@ void ST_CH_Array_Length::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.l)) {
         return;
     }
-    vmc->tmp->val_1.u4 = (u4) (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.la);
-    vmc->setRegister(vmc->tmp->dst, vmc->tmp->val_1.u4);
+    if (!VM_CONTEXT::vm->getArrayCache()->findLength(vmc->tmp->val_1.la, vmc->tmp->val_2.u4)) {
+        vmc->tmp->val_2.u4 = (u4) (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.la);
+    }
+    vmc->setRegister(vmc->tmp->dst, vmc->tmp->val_2.u4);
     vmc->pc_off(1);
 }
 
 void ST_CH_New_Instance::run(VmMethodContext *vmc) {
+    if (VmFusion::fuseStringBuilder(vmc)) {
+        return;
+    }
     vmc->tmp->dst = vmc->inst_AA();
     vmc->tmp->val_1.u4 = vmc->fetch(1);
     LOG_D_VM("|new-instance v%u,class@%u", vmc->tmp->dst, vmc->tmp->val_1.u4);
@@ -819,6 +866,10 @@ void ST_CH_New_Instance::run(VmMethodContext *vmc) {
         JavaException::throwJavaException(vmc);
         return;
     }
+    if (VmFusion::deferNewInstance(vmc, vmc->tmp->val_1.lc)) {
+        vmc->pc_off(2);
+        return;
+    }
     vmc->tmp->val_2.l = (*VM_CONTEXT::env).AllocObject(vmc->tmp->val_1.lc);
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_2.l)) {
         return;
@@ -840,12 +891,17 @@ void ST_CH_New_Array::run(VmMethodContext *vmc) {
         JavaException::throwNegativeArraySizeException(vmc, vmc->tmp->val_2.s4);
         return;
     }
+    const char type = vmc->method->dexFile->dexStringByTypeIdx(vmc->tmp->val_1.u4)[1];
     vmc->tmp->val_1.la = vmc->method->allocArray(vmc->tmp->val_2.s4, vmc->tmp->val_1.u4);
     if (vmc->tmp->val_1.la == nullptr) {
         JavaException::throwRuntimeException(vmc, "error type of field... cc");
         return;
     }
     vmc->setRegisterAsObject(vmc->tmp->dst, vmc->tmp->val_1.l);
+    vmc->tmp->lastNewArray = vmc->tmp->val_1.la;
+    vmc->tmp->lastNewArrayType = type;
+    vmc->tmp->lastNewArrayLength = vmc->tmp->val_2.u4;
+    vmc->tmp->lastNewArrayEpoch = vmc->tmp->refEpoch;
     vmc->pc_off(2);
 }
 
@@ -867,6 +923,9 @@ void ST_CH_Fill_Array_Data::run(VmMethodContext *vmc) {
 
     const u2 *data = vmc->arrayData(vmc->tmp->val_1.s4);
     vmc->tmp->val_1.l = vmc->getRegisterAsObject(vmc->tmp->src1);
+    if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.l)) {
+        return;
+    }
     /*
      * Array data table format:
      *  ushort ident = 0x0300   magic value
@@ -882,14 +941,27 @@ void ST_CH_Fill_Array_Data::run(VmMethodContext *vmc) {
         return;
     }
     u4 size = data[2] | ((u4) data[3] << 16u);
-    if (size > (*env).GetArrayLength(vmc->tmp->val_1.la)) {
-        JavaException::throwArrayIndexOutOfBoundsException(
-                vmc, (*env).GetArrayLength(vmc->tmp->val_1.la), size);
+    VmArrayCache *arrayCache = VM_CONTEXT::vm->getArrayCache();
+    char type;
+    if (vmc->tmp->val_1.la == vmc->tmp->lastNewArray &&
+        vmc->tmp->lastNewArrayEpoch == vmc->tmp->refEpoch) {
+        // right after its new-array, the usual shape of static tables.
+        type = vmc->tmp->lastNewArrayType;
+        vmc->tmp->val_2.u4 = vmc->tmp->lastNewArrayLength;
+        arrayCache->flush(vmc->tmp->val_1.la, false);
+    } else {
+        type = this->findArrayType(vmc);
+        if (!arrayCache->findLength(vmc->tmp->val_1.la, vmc->tmp->val_2.u4)) {
+            vmc->tmp->val_2.u4 = (*env).GetArrayLength(vmc->tmp->val_1.la);
+        }
+        // the cached elements are overwritten below.
+        arrayCache->flush(vmc->tmp->val_1.la, true);
+    }
+    if (size > vmc->tmp->val_2.u4) {
+        JavaException::throwArrayIndexOutOfBoundsException(vmc, vmc->tmp->val_2.u4, size);
         return;
     }
-    const std::string desc = VmMethod::getClassDescriptorByJClass(
-            (*env).GetObjectClass(vmc->tmp->val_1.l));
-    switch (desc[1]) {
+    switch (type) {
         case 'I':
             (*env).SetIntArrayRegion(vmc->tmp->val_1.lia, 0, size, (jint *) (data + 4));
             break;
@@ -923,13 +995,31 @@ void ST_CH_Fill_Array_Data::run(VmMethodContext *vmc) {
             break;
 
         default:
-            LOG_E("Unknown primitive type '%c'", desc[1]);
+            LOG_E("Unknown primitive type '%c'", type);
             throw VMException("error type of field... cc");
             return;
     }
     vmc->pc_off(3);
 }
 
+thread_local std::map<const u2 *, char> ST_CH_Fill_Array_Data::arrayTypes;
+
+char ST_CH_Fill_Array_Data::findArrayType(VmMethodContext *vmc) {
+    JNIEnv *env = VM_CONTEXT::env;
+    auto it = ST_CH_Fill_Array_Data::arrayTypes.find(vmc->cur_insns());
+    if (it != ST_CH_Fill_Array_Data::arrayTypes.end() &&
+        (*env).IsInstanceOf(vmc->tmp->val_1.l,
+                            VM_CONTEXT::vm->findPrimitiveArrayClass(it->second))) {
+        return it->second;
+    }
+    jclass clazz = (*env).GetObjectClass(vmc->tmp->val_1.l);
+    const std::string desc = VmMethod::getClassDescriptorByJClass(clazz);
+    (*env).DeleteLocalRef(clazz);
+    assert(desc.size() == 2 && desc[0] == '[');
+    ST_CH_Fill_Array_Data::arrayTypes[vmc->cur_insns()] = desc[1];
+    return desc[1];
+}
+
 void ST_CH_Throw::run(VmMethodContext *vmc) {
     vmc->tmp->src1 = vmc->inst_AA();
     LOG_D_VM("throw v%u  (%p)",
@@ -1113,9 +1203,7 @@ void ST_CH_CMP_Long::run(VmMethodContext *vmc) {
 void ST_CH_IF_EQ::run(VmMethodContext *vmc) {
     vmc->tmp->src1 = vmc->inst_A();
     vmc->tmp->src2 = vmc->inst_B();
-    vmc->tmp->val_1.s4 = (s4) vmc->getRegister(vmc->tmp->src1);
-    vmc->tmp->val_2.s4 = (s4) vmc->getRegister(vmc->tmp->src2);
-    if (vmc->tmp->val_1.s4 == vmc->tmp->val_2.s4) {
+    if (vmc->isRegisterEqual(vmc->tmp->src1, vmc->tmp->src2)) {
         vmc->tmp->val_1.s4 = (s2) vmc->fetch(1); /* sign-extended */
         LOG_D_VM("|if-%s v%u,v%u,+%d",
                  "eq", vmc->tmp->src1, vmc->tmp->src2, vmc->tmp->val_1.s4);
@@ -1131,9 +1219,7 @@ void ST_CH_IF_EQ::run(VmMethodContext *vmc) {
 void ST_CH_IF_NE::run(VmMethodContext *vmc) {
     vmc->tmp->src1 = vmc->inst_A();
     vmc->tmp->src2 = vmc->inst_B();
-    vmc->tmp->val_1.s4 = (s4) vmc->getRegister(vmc->tmp->src1);
-    vmc->tmp->val_2.s4 = (s4) vmc->getRegister(vmc->tmp->src2);
-    if (vmc->tmp->val_1.s4 != vmc->tmp->val_2.s4) {
+    if (!vmc->isRegisterEqual(vmc->tmp->src1, vmc->tmp->src2)) {
         vmc->tmp->val_1.s4 = (s2) vmc->fetch(1); /* sign-extended */
         LOG_D_VM("|if-%s v%u,v%u,+%d",
                  "ne", vmc->tmp->src1, vmc->tmp->src2, vmc->tmp->val_1.s4);
@@ -1313,15 +1399,14 @@ void ST_CH_Aget::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lia)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lia);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lia, 'I', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetIntArrayRegion(
-            vmc->tmp->val_1.lia, vmc->getRegister(vmc->tmp->src2), 1, (jint *) buf);
     vmc->setRegisterInt(vmc->tmp->dst, *(jint *) buf);
     LOG_D_VM("+ AGET[%u]=%d",
              vmc->getRegister(vmc->tmp->src2),
@@ -1340,15 +1425,14 @@ void ST_CH_Aget_Wide::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lja)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lja);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lja, 'J', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetLongArrayRegion(
-            vmc->tmp->val_1.lja, vmc->getRegister(vmc->tmp->src2), 1, (jlong *) buf);
     vmc->setRegisterLong(vmc->tmp->dst, *(jlong *) buf);
     LOG_D_VM("+ AGET[%u]=%ld",
              vmc->getRegister(vmc->tmp->src2),
@@ -1393,15 +1477,14 @@ void ST_CH_Aget_Boolean::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lza)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lza);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lza, 'Z', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetBooleanArrayRegion(
-            vmc->tmp->val_1.lza, vmc->getRegister(vmc->tmp->src2), 1, (jboolean *) buf);
     vmc->setRegister(vmc->tmp->dst, *(jboolean *) buf);
     LOG_D_VM("+ AGET[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
@@ -1420,15 +1503,14 @@ void ST_CH_Aget_Byte::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lba)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lba);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lba, 'B', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetByteArrayRegion(
-            vmc->tmp->val_1.lba, vmc->getRegister(vmc->tmp->src2), 1, (jbyte *) buf);
     vmc->setRegister(vmc->tmp->dst, *(jbyte *) buf);
     LOG_D_VM("+ AGET[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
@@ -1447,15 +1529,14 @@ void ST_CH_Aget_Char::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lca)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lca);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lca, 'C', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetCharArrayRegion(
-            vmc->tmp->val_1.lca, vmc->getRegister(vmc->tmp->src2), 1, (jchar *) buf);
     vmc->setRegister(vmc->tmp->dst, *(jchar *) buf);
     LOG_D_VM("+ AGET[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
@@ -1474,15 +1555,14 @@ void ST_CH_Aget_Short::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lsa)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lsa);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lsa, 'S', vmc->getRegister(vmc->tmp->src2), false,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
     }
-    u8 buf[1];
-    (*VM_CONTEXT::env).GetShortArrayRegion(
-            vmc->tmp->val_1.lsa, vmc->getRegister(vmc->tmp->src2), 1, (jshort *) buf);
     vmc->setRegister(vmc->tmp->dst, *(jshort *) buf);
     LOG_D_VM("+ AGET[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
@@ -1501,8 +1581,10 @@ void ST_CH_Aput::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lia)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lia);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lia, 'I', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1510,10 +1592,7 @@ void ST_CH_Aput::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%d",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegisterInt(vmc->tmp->dst));
-    u8 buf[1];
     *(jint *) buf = vmc->getRegister(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetIntArrayRegion(
-            vmc->tmp->val_1.lia, vmc->getRegister(vmc->tmp->src2), 1, (jint *) buf);
     vmc->pc_off(2);
 }
 
@@ -1528,8 +1607,10 @@ void ST_CH_Aput_Wide::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lja)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lja);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lja, 'J', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1537,10 +1618,7 @@ void ST_CH_Aput_Wide::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%ld",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegisterLong(vmc->tmp->dst));
-    u8 buf[1];
     *(jlong *) buf = vmc->getRegisterLong(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetLongArrayRegion(
-            vmc->tmp->val_1.lja, vmc->getRegister(vmc->tmp->src2), 1, (jlong *) buf);
     vmc->pc_off(2);
 }
 
@@ -1580,8 +1658,10 @@ void ST_CH_Aput_Boolean::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lza)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lza);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lza, 'Z', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1589,10 +1669,7 @@ void ST_CH_Aput_Boolean::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegister(vmc->tmp->dst));
-    u8 buf[1];
     *(jboolean *) buf = vmc->getRegister(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetBooleanArrayRegion(
-            vmc->tmp->val_1.lza, vmc->getRegister(vmc->tmp->src2), 1, (jboolean *) buf);
     vmc->pc_off(2);
 }
 
@@ -1607,8 +1684,10 @@ void ST_CH_Aput_Byte::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lba)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lba);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lba, 'B', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1616,10 +1695,7 @@ void ST_CH_Aput_Byte::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegister(vmc->tmp->dst));
-    u8 buf[1];
     *(jbyte *) buf = vmc->getRegister(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetByteArrayRegion(
-            vmc->tmp->val_1.lba, vmc->getRegister(vmc->tmp->src2), 1, (jbyte *) buf);
     vmc->pc_off(2);
 }
 
@@ -1634,8 +1710,10 @@ void ST_CH_Aput_Char::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lca)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lca);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lca, 'C', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1643,10 +1721,7 @@ void ST_CH_Aput_Char::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegister(vmc->tmp->dst));
-    u8 buf[1];
     *(jchar *) buf = vmc->getRegister(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetCharArrayRegion(
-            vmc->tmp->val_1.lca, vmc->getRegister(vmc->tmp->src2), 1, (jchar *) buf);
     vmc->pc_off(2);
 }
 
@@ -1661,8 +1736,10 @@ void ST_CH_Aput_Short::run(VmMethodContext *vmc) {
     if (!JavaException::checkForNull(vmc, vmc->tmp->val_1.lsa)) {
         return;
     }
-    vmc->tmp->val_2.u4 = (*VM_CONTEXT::env).GetArrayLength(vmc->tmp->val_1.lsa);
-    if (vmc->tmp->val_2.u4 <= vmc->getRegister(vmc->tmp->src2)) {
+    u1 *buf = VM_CONTEXT::vm->getArrayCache()->element(
+            vmc->tmp->val_1.lsa, 'S', vmc->getRegister(vmc->tmp->src2), true,
+            vmc->tmp->val_2.u4);
+    if (buf == nullptr) {
         JavaException::throwArrayIndexOutOfBoundsException(
                 vmc, vmc->tmp->val_2.u4, vmc->getRegister(vmc->tmp->src2));
         return;
@@ -1670,10 +1747,7 @@ void ST_CH_Aput_Short::run(VmMethodContext *vmc) {
     LOG_D_VM("+ APUT[%u]=%u",
              vmc->getRegister(vmc->tmp->src2),
              vmc->getRegister(vmc->tmp->dst));
-    u8 buf[1];
     *(jshort *) buf = vmc->getRegister(vmc->tmp->dst);
-    (*VM_CONTEXT::env).SetShortArrayRegion(
-            vmc->tmp->val_1.lsa, vmc->getRegister(vmc->tmp->src2), 1, (jshort *) buf);
     vmc->pc_off(2);
 }
 
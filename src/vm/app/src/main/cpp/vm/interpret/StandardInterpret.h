@@ -214,6 +214,13 @@ public:
 class ST_CH_Fill_Array_Data : public CodeHandler {
 public:
     void run(VmMethodContext *vmc) override;
+
+private:
+    // key: fill-array-data, value: the element type it filled last time.
+    // the handler is shared, every thread keeps its own map.
+    static thread_local std::map<const u2 *, char> arrayTypes;
+
+    char findArrayType(VmMethodContext *vmc);
 };
 
 class ST_CH_Throw : public CodeHandler {
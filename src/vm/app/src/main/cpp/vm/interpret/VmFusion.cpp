@@ -0,0 +1,375 @@
+//
+// Created by 陈泽伦 on 1/8/21.
+//
+
+#include "VmFusion.h"
+#include "../../VmContext.h"
+#include "../JavaException.h"
+#include <cstring>
+
+static const char kStringBuilder[] = "Ljava/lang/StringBuilder;";
+static const size_t kMaxChainSteps = 64;
+
+struct VmAppendSign {
+    const char *sign;
+    VmChainStepKind kind;
+    // registers of the invoke, including the builder.
+    u2 count;
+};
+
+static const VmAppendSign kAppendSigns[] = {
+        {"(I)Ljava/lang/StringBuilder;",                  AppendInt,     2},
+        {"(J)Ljava/lang/StringBuilder;",                  AppendLong,    3},
+        {"(C)Ljava/lang/StringBuilder;",                  AppendChar,    2},
+        {"(Z)Ljava/lang/StringBuilder;",                  AppendBoolean, 2},
+        {"(Ljava/lang/String;)Ljava/lang/StringBuilder;", AppendString,  2},
+};
+
+thread_local std::map<const u2 *, std::unique_ptr<VmStringChain>> VmFusion::stringChains;
+thread_local std::map<const u2 *, const u2 *> VmFusion::newInstances;
+
+bool VmFusion::fuseStringBuilder(VmMethodContext *vmc) {
+    auto it = VmFusion::stringChains.find(vmc->cur_insns());
+    if (it == VmFusion::stringChains.end()) {
+        it = VmFusion::stringChains.emplace(
+                vmc->cur_insns(), VmFusion::parseStringChain(vmc)).first;
+    }
+    const VmStringChain *chain = it->second.get();
+    if (chain == nullptr) {
+        return false;
+    }
+
+    std::vector<jchar> chars;
+    if (chain->hasInitString) {
+        jobject str = vmc->getRegisterAsObject(chain->initReg);
+        if (str == nullptr) {
+            // NullPointerException by StringBuilder.<init>.
+            return false;
+        }
+        VmFusion::appendString(str, chars);
+    }
+    char buf[24];
+    jstring str;
+    for (const auto &step : chain->steps) {
+        switch (step.kind) {
+            case AppendInt:
+                snprintf(buf, sizeof(buf), "%d", vmc->getRegisterInt(step.reg));
+                chars.insert(chars.end(), buf, buf + strlen(buf));
+                break;
+
+            case AppendLong:
+                snprintf(buf, sizeof(buf), "%lld", (long long) vmc->getRegisterLong(step.reg));
+                chars.insert(chars.end(), buf, buf + strlen(buf));
+                break;
+
+            case AppendChar:
+                chars.push_back((jchar) vmc->getRegister(step.reg));
+                break;
+
+            case AppendBoolean:
+                strcpy(buf, vmc->getRegister(step.reg) != 0 ? "true" : "false");
+                chars.insert(chars.end(), buf, buf + strlen(buf));
+                break;
+
+            case AppendString:
+                VmFusion::appendString(vmc->getRegisterAsObject(step.reg), chars);
+                break;
+
+            case ConstString:
+                // a slot of the dex cache, the ref may be trimmed between two runs.
+                str = vmc->method->resolveString(step.val.u4);
+                if (str == nullptr) {
+                    // throws when it runs without fusion.
+                    (*VM_CONTEXT::env).ExceptionClear();
+                    return false;
+                }
+                vmc->setRegisterAsObject(step.reg, str);
+                break;
+
+            case Const:
+                vmc->setRegister(step.reg, step.val.u4);
+                break;
+
+            case ConstWide:
+                vmc->setRegisterWide(step.reg, step.val.u8);
+                break;
+        }
+    }
+
+    jstring result = (*VM_CONTEXT::env).NewString(chars.data(), chars.size());
+    if (result == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return true;
+    }
+    LOG_D_VM("fused StringBuilder chain, steps: %zu, length: %zu",
+             chain->steps.size(), chars.size());
+    vmc->setRegisterAsObject(chain->builderReg, result);
+    vmc->pc_off(chain->insnsSize);
+    return true;
+}
+
+std::unique_ptr<VmStringChain> VmFusion::parseStringChain(VmMethodContext *vmc) {
+    const u2 *insns = vmc->cur_insns();
+    const u2 *end = vmc->method->code->insns + vmc->method->code->insnsSize;
+    DexFile *dexFile = vmc->method->dexFile;
+    if (strcmp(dexFile->dexStringByTypeIdx(insns[1]), kStringBuilder) != 0) {
+        return nullptr;
+    }
+
+    VmStringChain chain{};
+    chain.builderReg = insns[0] >> 8u;
+    // invoke-direct {vA(, vB)}, <init>
+    const u2 *cur = insns + 2;
+    if (end - cur < 3 || (cur[0] & 0xffu) != 0x70 || (cur[2] & 0x0fu) != chain.builderReg) {
+        return nullptr;
+    }
+    if ((cur[0] >> 12u) == 1 &&
+        VmFusion::isStringBuilderMethod(vmc, cur[1], "<init>", "()V")) {
+        chain.hasInitString = false;
+    } else if ((cur[0] >> 12u) == 2 &&
+               VmFusion::isStringBuilderMethod(vmc, cur[1], "<init>", "(Ljava/lang/String;)V")) {
+        chain.hasInitString = true;
+        chain.initReg = (cur[2] >> 4u) & 0x0fu;
+    } else {
+        return nullptr;
+    }
+    cur += 3;
+
+    while (cur < end && chain.steps.size() < kMaxChainSteps) {
+        VmChainStep step{};
+        u2 op = cur[0] & 0xffu;
+        step.reg = cur[0] >> 8u;
+        switch (op) {
+            case 0x12:  // const/4 vA, #+B
+                step.kind = Const;
+                step.reg = (cur[0] >> 8u) & 0x0fu;
+                step.val.s4 = (s4) ((s2) cur[0] >> 12u);
+                cur += 1;
+                break;
+
+            case 0x13:  // const/16 vAA, #+BBBB
+                step.kind = Const;
+                step.val.s4 = (s2) cur[1];
+                cur += 2;
+                break;
+
+            case 0x14:  // const vAA, #+BBBBBBBB
+                if (end - cur < 3) { return nullptr; }
+                step.kind = Const;
+                step.val.u4 = cur[1] | (u4) cur[2] << 16u;
+                cur += 3;
+                break;
+
+            case 0x15:  // const/high16 vAA, #+BBBB0000
+                step.kind = Const;
+                step.val.u4 = (u4) cur[1] << 16u;
+                cur += 2;
+                break;
+
+            case 0x16:  // const-wide/16 vAA, #+BBBB
+                step.kind = ConstWide;
+                step.val.s8 = (s2) cur[1];
+                cur += 2;
+                break;
+
+            case 0x17:  // const-wide/32 vAA, #+BBBBBBBB
+                if (end - cur < 3) { return nullptr; }
+                step.kind = ConstWide;
+                step.val.s8 = (s4) (cur[1] | (u4) cur[2] << 16u);
+                cur += 3;
+                break;
+
+            case 0x1a:  // const-string vAA, string@BBBB
+            case 0x1b:  // const-string/jumbo vAA, string@BBBBBBBB
+                if (op == 0x1b && end - cur < 3) { return nullptr; }
+                step.kind = ConstString;
+                step.val.u4 = op == 0x1a ? cur[1] : cur[1] | (u4) cur[2] << 16u;
+                if (vmc->method->resolveString(step.val.u4) == nullptr) {
+                    // throws when it runs without fusion.
+                    (*VM_CONTEXT::env).ExceptionClear();
+                    return nullptr;
+                }
+                cur += op == 0x1a ? 2 : 3;
+                break;
+
+            case 0x6e: {    // invoke-virtual {vA, ...}, StringBuilder
+                if (end - cur < 3 || (cur[2] & 0x0fu) != chain.builderReg) {
+                    return nullptr;
+                }
+                const u2 count = cur[0] >> 12u;
+                if (count == 1 && VmFusion::isStringBuilderMethod(
+                        vmc, cur[1], "toString", "()Ljava/lang/String;")) {
+                    // the builder register must be dead, so it takes the result.
+                    cur += 3;
+                    if (cur < end && (cur[0] & 0xffu) == 0x0c &&
+                        (cur[0] >> 8u) == chain.builderReg) {
+                        chain.insnsSize = cur + 1 - insns;
+                        return std::unique_ptr<VmStringChain>(new VmStringChain(chain));
+                    }
+                    return nullptr;
+                }
+                const VmAppendSign *append = nullptr;
+                for (const auto &it : kAppendSigns) {
+                    if (it.count == count &&
+                        VmFusion::isStringBuilderMethod(vmc, cur[1], "append", it.sign)) {
+                        append = &it;
+                        break;
+                    }
+                }
+                if (append == nullptr) {
+                    return nullptr;
+                }
+                step.kind = append->kind;
+                step.reg = (cur[2] >> 4u) & 0x0fu;
+                cur += 3;
+                // the returned builder.
+                if (cur < end && (cur[0] & 0xffu) == 0x0c) {
+                    if ((cur[0] >> 8u) != chain.builderReg) {
+                        return nullptr;
+                    }
+                    cur += 1;
+                }
+                break;
+            }
+
+            default:
+                return nullptr;
+        }
+
+        if ((step.kind == Const || step.kind == ConstString) &&
+            step.reg == chain.builderReg) {
+            return nullptr;
+        }
+        if (step.kind == ConstWide &&
+            (step.reg == chain.builderReg || step.reg + 1 == chain.builderReg)) {
+            return nullptr;
+        }
+        chain.steps.push_back(step);
+    }
+    return nullptr;
+}
+
+bool VmFusion::deferNewInstance(VmMethodContext *vmc, jclass clazz) {
+    const u2 *init;
+    auto it = VmFusion::newInstances.find(vmc->cur_insns());
+    if (it == VmFusion::newInstances.end()) {
+        init = VmFusion::parseNewInstance(vmc);
+        VmFusion::newInstances[vmc->cur_insns()] = init;
+    } else {
+        init = it->second;
+    }
+    if (init == nullptr) {
+        return false;
+    }
+    // VmJniMethodCaller allocates and constructs it by NewObjectA.
+    vmc->tmp->pendingInit = init;
+    vmc->tmp->pendingReg = vmc->inst_AA();
+    vmc->tmp->pendingClass = clazz;
+    vmc->setRegisterAsObject(vmc->tmp->pendingReg, nullptr);
+    return true;
+}
+
+const u2 *VmFusion::parseNewInstance(VmMethodContext *vmc) {
+    const u2 *insns = vmc->cur_insns();
+    const u2 *end = vmc->method->code->insns + vmc->method->code->insnsSize;
+    const u2 obj = insns[0] >> 8u;
+    const u2 clazzIdx = insns[1];
+    // only instructions which can't throw, branch or let the object escape.
+    for (const u2 *cur = insns + 2; cur < end;) {
+        const u2 op = cur[0] & 0xffu;
+        const u2 vA = cur[0] >> 8u;
+        switch (op) {
+            case 0x12:  // const/4 vA, #+B
+                if ((vA & 0x0fu) == obj) { return nullptr; }
+                cur += 1;
+                break;
+
+            case 0x13:  // const/16 vAA, #+BBBB
+            case 0x15:  // const/high16 vAA, #+BBBB0000
+                if (vA == obj) { return nullptr; }
+                cur += 2;
+                break;
+
+            case 0x14:  // const vAA, #+BBBBBBBB
+                if (vA == obj) { return nullptr; }
+                cur += 3;
+                break;
+
+            case 0x16:  // const-wide/16 vAA, #+BBBB
+            case 0x19:  // const-wide/high16 vAA, #+BBBB000000000000
+                if (vA == obj || vA + 1 == obj) { return nullptr; }
+                cur += 2;
+                break;
+
+            case 0x17:  // const-wide/32 vAA, #+BBBBBBBB
+                if (vA == obj || vA + 1 == obj) { return nullptr; }
+                cur += 3;
+                break;
+
+            case 0x18:  // const-wide vAA, #+BBBBBBBBBBBBBBBB
+                if (vA == obj || vA + 1 == obj) { return nullptr; }
+                cur += 5;
+                break;
+
+            case 0x01:  // move vA, vB
+            case 0x07:  // move-object vA, vB
+                if ((vA & 0x0fu) == obj || (vA >> 4u) == obj) { return nullptr; }
+                cur += 1;
+                break;
+
+            case 0x02:  // move/from16 vAA, vBBBB
+            case 0x08:  // move-object/from16 vAA, vBBBB
+                if (vA == obj || cur[1] == obj) { return nullptr; }
+                cur += 2;
+                break;
+
+            case 0x70:  // invoke-direct {vC, ...}, <init>
+            case 0x76: {    // invoke-direct/range {vCCCC .. vNNNN}, <init>
+                if (end - cur < 3) { return nullptr; }
+                const u2 thisReg = op == 0x70 ? cur[2] & 0x0fu : cur[2];
+                DexFile *dexFile = vmc->method->dexFile;
+                const DexMethodId *methodId = dexFile->dexGetMethodId(cur[1]);
+                if (thisReg != obj || methodId->classIdx != clazzIdx ||
+                    strcmp(dexFile->dexStringById(methodId->nameIdx), "<init>") != 0 ||
+                    Vm::isKeyFunction(cur[1])) {
+                    return nullptr;
+                }
+                LOG_D_VM("defer new-instance at %u to <init> at %u",
+                         (u4) (insns - vmc->method->code->insns),
+                         (u4) (cur - vmc->method->code->insns));
+                return cur;
+            }
+
+            default:
+                return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+bool VmFusion::isStringBuilderMethod(VmMethodContext *vmc, u4 idx,
+                                     const char *name, const char *sign) {
+    DexFile *dexFile = vmc->method->dexFile;
+    const DexMethodId *methodId = dexFile->dexGetMethodId(idx);
+    return strcmp(dexFile->dexStringByTypeIdx(methodId->classIdx), kStringBuilder) == 0 &&
+           strcmp(dexFile->dexStringById(methodId->nameIdx), name) == 0 &&
+           vmc->method->resolveMethodSign(methodId->protoIdx) == sign;
+}
+
+void VmFusion::appendString(jobject str, std::vector<jchar> &chars) {
+    if (str == nullptr) {
+        static const char kNull[] = "null";
+        chars.insert(chars.end(), kNull, kNull + 4);
+        return;
+    }
+    const VmStringEntry *entry = VM_CONTEXT::vm->getResolveCache()->findString(str);
+    if (entry != nullptr) {
+        chars.insert(chars.end(), entry->chars.begin(), entry->chars.end());
+        return;
+    }
+    JNIEnv *env = VM_CONTEXT::env;
+    jsize len = (*env).GetStringLength((jstring) str);
+    size_t off = chars.size();
+    chars.resize(off + len);
+    (*env).GetStringRegion((jstring) str, 0, len, chars.data() + off);
+}
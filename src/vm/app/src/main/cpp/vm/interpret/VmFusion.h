@@ -0,0 +1,71 @@
+//
+// Created by 陈泽伦 on 1/8/21.
+//
+
+#ifndef VM_VMFUSION_H
+#define VM_VMFUSION_H
+
+#include "../base/VmMethod.h"
+#include <map>
+#include <memory>
+#include <vector>
+
+enum VmChainStepKind {
+    AppendInt,
+    AppendLong,
+    AppendChar,
+    AppendBoolean,
+    AppendString,
+    ConstString,
+    Const,
+    ConstWide,
+};
+
+struct VmChainStep {
+    VmChainStepKind kind;
+    u2 reg;
+    // const value, or the string index of const-string.
+    RegValue val;
+};
+
+/**
+ * new-instance StringBuilder, <init>, append..., toString, move-result-object.
+ */
+struct VmStringChain {
+    u2 builderReg;
+    bool hasInitString;
+    u2 initReg;
+    std::vector<VmChainStep> steps;
+    // code units from new-instance to the end of the chain.
+    u4 insnsSize;
+};
+
+/**
+ * runs well-known instruction sequences as one native operation.
+ */
+class VmFusion {
+public:
+    static bool fuseStringBuilder(VmMethodContext *vmc);
+
+    static bool deferNewInstance(VmMethodContext *vmc, jclass clazz);
+
+private:
+    // one map per thread, never locked.
+    // key: new-instance, value: nullptr if not a chain.
+    static thread_local std::map<const u2 *, std::unique_ptr<VmStringChain>> stringChains;
+
+    // key: new-instance, value: its invoke-direct <init> or nullptr.
+    static thread_local std::map<const u2 *, const u2 *> newInstances;
+
+    static std::unique_ptr<VmStringChain> parseStringChain(VmMethodContext *vmc);
+
+    static const u2 *parseNewInstance(VmMethodContext *vmc);
+
+    static bool isStringBuilderMethod(VmMethodContext *vmc, u4 idx,
+                                      const char *name, const char *sign);
+
+    static void appendString(jobject str, std::vector<jchar> &chars);
+};
+
+
+#endif //VM_VMFUSION_H
@@ -0,0 +1,433 @@
+//
+// Created by 陈泽伦 on 1/5/21.
+//
+
+#include "VmIntrinsics.h"
+#include "../../VmContext.h"
+#include "../JavaException.h"
+#include <cmath>
+#include <cstring>
+
+thread_local std::map<const u2 *, VmIntrinsicSite> VmIntrinsics::sites;
+
+// java.lang.Math
+
+static bool Math_abs_I(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->i = args[0].i < 0 ? (jint) (0u - (u4) args[0].i) : args[0].i;
+    return true;
+}
+
+static bool Math_abs_J(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->j = args[0].j < 0 ? (jlong) (0UL - (u8) args[0].j) : args[0].j;
+    return true;
+}
+
+static bool Math_abs_F(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    // clear the sign bit, keeps NaN and turns -0.0f into 0.0f.
+    retVal->i = args[0].i & 0x7fffffff;
+    return true;
+}
+
+static bool Math_abs_D(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->j = args[0].j & 0x7fffffffffffffffL;
+    return true;
+}
+
+static bool Math_max_II(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->i = args[0].i >= args[1].i ? args[0].i : args[1].i;
+    return true;
+}
+
+static bool Math_min_II(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->i = args[0].i <= args[1].i ? args[0].i : args[1].i;
+    return true;
+}
+
+static bool Math_max_JJ(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->j = args[0].j >= args[1].j ? args[0].j : args[1].j;
+    return true;
+}
+
+static bool Math_min_JJ(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->j = args[0].j <= args[1].j ? args[0].j : args[1].j;
+    return true;
+}
+
+// NaN wins, and 0.0 is greater than -0.0.
+template<typename T>
+static T maxOf(T a, T b) {
+    if (a != a) {
+        return a;
+    }
+    if (a == 0 && b == 0 && std::signbit(a)) {
+        return b;
+    }
+    return a >= b ? a : b;
+}
+
+template<typename T>
+static T minOf(T a, T b) {
+    if (a != a) {
+        return a;
+    }
+    if (a == 0 && b == 0 && std::signbit(b)) {
+        return b;
+    }
+    return a <= b ? a : b;
+}
+
+static bool Math_max_FF(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->f = maxOf(args[0].f, args[1].f);
+    return true;
+}
+
+static bool Math_min_FF(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->f = minOf(args[0].f, args[1].f);
+    return true;
+}
+
+static bool Math_max_DD(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->d = maxOf(args[0].d, args[1].d);
+    return true;
+}
+
+static bool Math_min_DD(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->d = minOf(args[0].d, args[1].d);
+    return true;
+}
+
+static bool Math_sqrt_D(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->d = std::sqrt(args[0].d);
+    return true;
+}
+
+static bool Math_floor_D(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->d = std::floor(args[0].d);
+    return true;
+}
+
+static bool Math_ceil_D(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    retVal->d = std::ceil(args[0].d);
+    return true;
+}
+
+static bool Math_rint_D(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    // round half to even under the default rounding mode.
+    retVal->d = std::nearbyint(args[0].d);
+    return true;
+}
+
+// java.lang.String, only the constants of the dex are known.
+
+static bool String_length(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    const VmStringEntry *str = VM_CONTEXT::vm->getResolveCache()->findString(args[0].l);
+    if (str == nullptr) {
+        return false;
+    }
+    retVal->i = str->chars.size();
+    return true;
+}
+
+static bool String_isEmpty(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    const VmStringEntry *str = VM_CONTEXT::vm->getResolveCache()->findString(args[0].l);
+    if (str == nullptr) {
+        return false;
+    }
+    retVal->z = str->chars.empty() ? JNI_TRUE : JNI_FALSE;
+    return true;
+}
+
+static bool String_charAt(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    const VmStringEntry *str = VM_CONTEXT::vm->getResolveCache()->findString(args[0].l);
+    if (str == nullptr || args[1].i < 0 || (u4) args[1].i >= str->chars.size()) {
+        // StringIndexOutOfBoundsException by jni.
+        return false;
+    }
+    retVal->c = str->chars[args[1].i];
+    return true;
+}
+
+static bool String_hashCode(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    const VmStringEntry *str = VM_CONTEXT::vm->getResolveCache()->findString(args[0].l);
+    if (str == nullptr) {
+        return false;
+    }
+    u4 hash = 0;
+    for (jchar c : str->chars) {
+        hash = 31u * hash + c;
+    }
+    retVal->i = (jint) hash;
+    return true;
+}
+
+static bool String_equals(
+        VmMethodContext *, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    VmResolveCache *resolveCache = VM_CONTEXT::vm->getResolveCache();
+    const VmStringEntry *str = resolveCache->findString(args[0].l);
+    if (str == nullptr) {
+        return false;
+    }
+    if (args[1].l == nullptr) {
+        retVal->z = JNI_FALSE;
+        return true;
+    }
+    const VmStringEntry *other = resolveCache->findString(args[1].l);
+    if (other == nullptr) {
+        return false;
+    }
+    retVal->z = str->chars == other->chars ? JNI_TRUE : JNI_FALSE;
+    return true;
+}
+
+// java.lang.Integer, at most one upcall with the cached method.
+
+static bool Integer_valueOf(
+        VmMethodContext *vmc, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    VmResolveCache *resolveCache = VM_CONTEXT::vm->getResolveCache();
+    const jint value = args[0].i;
+    const bool isCached = VM_INTEGER_CACHE_LOW <= value && value <= VM_INTEGER_CACHE_HIGH;
+    if (isCached && (retVal->l = resolveCache->findInteger(value)) != nullptr) {
+        return true;
+    }
+    jmethodID mValueOf = vmc->method->resolveMethod(vmc->tmp->val_1.u4, true);
+    if (mValueOf == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return true;
+    }
+    jclass cInteger = vmc->method->resolveClass(
+            vmc->method->dexFile->dexGetMethodId(vmc->tmp->val_1.u4)->classIdx);
+    jobject box = (*VM_CONTEXT::env).CallStaticObjectMethodA(cInteger, mValueOf, args);
+    if (box == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return true;
+    }
+    // the same instance as Integer.valueOf returns, so == still works.
+    retVal->l = isCached ? resolveCache->cacheInteger(value, box) : box;
+    return true;
+}
+
+static bool Integer_intValue(
+        VmMethodContext *vmc, VmIntrinsicSite *, const jvalue *args, jvalue *retVal) {
+    if (args[0].l == nullptr) {
+        return false;
+    }
+    if (VM_CONTEXT::vm->getResolveCache()->findIntegerValue(args[0].l, retVal->i)) {
+        return true;
+    }
+    jmethodID mIntValue = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
+    if (mIntValue == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return true;
+    }
+    retVal->i = (*VM_CONTEXT::env).CallIntMethod(args[0].l, mIntValue);
+    return true;
+}
+
+// java.util.ArrayList, which runs no unknown java code in size and get.
+
+static bool isArrayList(VmMethodContext *vmc, VmIntrinsicSite *site, jobject obj) {
+    if (site->receiver == obj && site->refEpoch == vmc->tmp->refEpoch) {
+        return site->isExact;
+    }
+    JNIEnv *env = VM_CONTEXT::env;
+    // a magic static, made once even if threads race for it.
+    static const jclass cArrayList = [env]() {
+        jclass clazz = (*env).FindClass(VM_REFLECT::C_NAME_ArrayList);
+        auto ret = (jclass) (*env).NewGlobalRef(clazz);
+        (*env).DeleteLocalRef(clazz);
+        return ret;
+    }();
+    // a subclass may override them.
+    jclass clazz = (*env).GetObjectClass(obj);
+    site->receiver = obj;
+    site->refEpoch = vmc->tmp->refEpoch;
+    site->isExact = (*env).IsSameObject(clazz, cArrayList);
+    site->hasVal = false;
+    (*env).DeleteLocalRef(clazz);
+    return site->isExact;
+}
+
+static bool ArrayList_size(
+        VmMethodContext *vmc, VmIntrinsicSite *site, const jvalue *args, jvalue *retVal) {
+    if (args[0].l == nullptr || !isArrayList(vmc, site, args[0].l)) {
+        return false;
+    }
+    // stable until unknown java code runs, e.g. list.add().
+    if (!site->hasVal || site->epoch != vmc->tmp->epoch) {
+        jmethodID mSize = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
+        if (mSize == nullptr) {
+            JavaException::throwJavaException(vmc);
+            return true;
+        }
+        site->val.i = (*VM_CONTEXT::env).CallIntMethod(args[0].l, mSize);
+        site->hasVal = true;
+        site->epoch = vmc->tmp->epoch;
+    }
+    retVal->i = site->val.i;
+    return true;
+}
+
+static bool ArrayList_get(
+        VmMethodContext *vmc, VmIntrinsicSite *site, const jvalue *args, jvalue *retVal) {
+    if (args[0].l == nullptr || !isArrayList(vmc, site, args[0].l)) {
+        return false;
+    }
+    jmethodID mGet = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
+    if (mGet == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return true;
+    }
+    retVal->l = (*VM_CONTEXT::env).CallObjectMethodA(args[0].l, mGet, args + 1);
+    if (retVal->l == nullptr && (*VM_CONTEXT::env).ExceptionCheck()) {
+        // IndexOutOfBoundsException
+        JavaException::throwJavaException(vmc);
+    }
+    return true;
+}
+
+const VmIntrinsic VmIntrinsics::intrinsics[] = {
+        {"Ljava/lang/Math;",      "abs",      "(I)I",                   true,  Math_abs_I},
+        {"Ljava/lang/Math;",      "abs",      "(J)J",                   true,  Math_abs_J},
+        {"Ljava/lang/Math;",      "abs",      "(F)F",                   true,  Math_abs_F},
+        {"Ljava/lang/Math;",      "abs",      "(D)D",                   true,  Math_abs_D},
+        {"Ljava/lang/Math;",      "max",      "(II)I",                  true,  Math_max_II},
+        {"Ljava/lang/Math;",      "min",      "(II)I",                  true,  Math_min_II},
+        {"Ljava/lang/Math;",      "max",      "(JJ)J",                  true,  Math_max_JJ},
+        {"Ljava/lang/Math;",      "min",      "(JJ)J",                  true,  Math_min_JJ},
+        {"Ljava/lang/Math;",      "max",      "(FF)F",                  true,  Math_max_FF},
+        {"Ljava/lang/Math;",      "min",      "(FF)F",                  true,  Math_min_FF},
+        {"Ljava/lang/Math;",      "max",      "(DD)D",                  true,  Math_max_DD},
+        {"Ljava/lang/Math;",      "min",      "(DD)D",                  true,  Math_min_DD},
+        {"Ljava/lang/Math;",      "sqrt",     "(D)D",                   true,  Math_sqrt_D},
+        {"Ljava/lang/Math;",      "floor",    "(D)D",                   true,  Math_floor_D},
+        {"Ljava/lang/Math;",      "ceil",     "(D)D",                   true,  Math_ceil_D},
+        {"Ljava/lang/Math;",      "rint",     "(D)D",                   true,  Math_rint_D},
+        {"Ljava/lang/String;",    "length",   "()I",                    false, String_length},
+        {"Ljava/lang/String;",    "isEmpty",  "()Z",                    false, String_isEmpty},
+        {"Ljava/lang/String;",    "charAt",   "(I)C",                   false, String_charAt},
+        {"Ljava/lang/String;",    "hashCode", "()I",                    false, String_hashCode},
+        {"Ljava/lang/String;",    "equals",   "(Ljava/lang/Object;)Z",  false, String_equals},
+        {"Ljava/lang/Integer;",   "valueOf",  "(I)Ljava/lang/Integer;", true,  Integer_valueOf},
+        {"Ljava/lang/Integer;",   "intValue", "()I",                    false, Integer_intValue},
+        {"Ljava/util/ArrayList;", "size",     "()I",                    false, ArrayList_size},
+        {"Ljava/util/List;",      "size",     "()I",                    false, ArrayList_size},
+        {"Ljava/util/ArrayList;", "get",      "(I)Ljava/lang/Object;",  false, ArrayList_get},
+        {"Ljava/util/List;",      "get",      "(I)Ljava/lang/Object;",  false, ArrayList_get},
+};
+
+bool VmIntrinsics::invoke(VmMethodContext *vmc) {
+    if (vmc->isCallSuperMethod()) {
+        return false;
+    }
+    auto it = VmIntrinsics::sites.find(vmc->cur_insns());
+    if (it == VmIntrinsics::sites.end()) {
+        VmIntrinsicSite site{};
+        site.intrinsic = VmIntrinsics::match(vmc);
+        it = VmIntrinsics::sites.emplace(vmc->cur_insns(), site).first;
+    }
+    const VmIntrinsic *intrinsic = it->second.intrinsic;
+    if (intrinsic == nullptr) {
+        return false;
+    }
+
+    jvalue args[4];
+    jvalue retVal;
+    retVal.j = 0L;
+    VmIntrinsics::fetchArgs(vmc, args);
+    if (!intrinsic->func(vmc, &it->second, args, &retVal)) {
+        LOG_D_VM("intrinsic %s->%s%s falls back to jni.",
+                 intrinsic->clazzDescriptor, intrinsic->name, intrinsic->sign);
+        return false;
+    }
+    *vmc->retVal = retVal;
+    return true;
+}
+
+const VmIntrinsic *VmIntrinsics::match(VmMethodContext *vmc) {
+    DexFile *dexFile = vmc->method->dexFile;
+    const DexMethodId *methodId = dexFile->dexGetMethodId(vmc->tmp->val_1.u4);
+    const char *clazzDescriptor = dexFile->dexStringByTypeIdx(methodId->classIdx);
+    const char *name = dexFile->dexStringById(methodId->nameIdx);
+    std::string sign;
+    for (const auto &intrinsic : VmIntrinsics::intrinsics) {
+        if (intrinsic.isStatic != vmc->isCallStaticMethod() ||
+            strcmp(intrinsic.clazzDescriptor, clazzDescriptor) != 0 ||
+            strcmp(intrinsic.name, name) != 0) {
+            continue;
+        }
+        if (sign.empty()) {
+            sign = vmc->method->resolveMethodSign(methodId->protoIdx);
+        }
+        if (sign == intrinsic.sign) {
+            LOG_D_VM("intrinsic: %s->%s%s", clazzDescriptor, name, sign.data());
+            return &intrinsic;
+        }
+    }
+    return nullptr;
+}
+
+void VmIntrinsics::fetchArgs(const VmMethodContext *vmc, jvalue *args) {
+    // every intrinsic takes at most 4 registers.
+    u2 regs[5];
+    u2 count;
+    if (vmc->isCallMethodRange()) {
+        count = vmc->tmp->src1;
+        assert(count <= 4);
+        for (u2 i = 0; i < count; i++) {
+            regs[i] = vmc->tmp->dst + i;
+        }
+    } else {
+        count = vmc->tmp->src1 >> 4u;
+        for (u2 i = 0; i < count && i < 4; i++) {
+            regs[i] = (vmc->tmp->dst >> (i << 2u)) & 0x0fu;
+        }
+        if (count == 5) {
+            regs[4] = vmc->tmp->src1 & 0x0fu;
+        }
+    }
+
+    u2 regIdx = 0;
+    u2 argIdx = 0;
+    if (!vmc->isCallStaticMethod()) {
+        args[argIdx++].l = vmc->getRegisterAsObject(regs[regIdx++]);
+    }
+    const char *shorty = vmc->method->dexFile->dexGetMethodShorty(vmc->tmp->val_1.u4);
+    for (const char *type = shorty + 1; *type != '\0'; type++, argIdx++) {
+        switch (*type) {
+            case 'D':
+            case 'J':
+                args[argIdx].j = vmc->getRegisterWide(regs[regIdx]);
+                regIdx += 2;
+                break;
+
+            case 'L':
+                args[argIdx].l = vmc->getRegisterAsObject(regs[regIdx++]);
+                break;
+
+            default:
+                args[argIdx].i = vmc->getRegisterInt(regs[regIdx++]);
+                break;
+        }
+    }
+    assert(regIdx == count);
+}
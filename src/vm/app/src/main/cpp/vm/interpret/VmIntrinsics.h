@@ -0,0 +1,59 @@
+//
+// Created by 陈泽伦 on 1/5/21.
+//
+
+#ifndef VM_VMINTRINSICS_H
+#define VM_VMINTRINSICS_H
+
+#include "../base/VmMethod.h"
+#include <map>
+
+struct VmIntrinsicSite;
+
+/**
+ * run the callee natively, return false to fall back to jni,
+ * e.g. the java method would throw.
+ */
+typedef bool (*VmIntrinsicFunc)(VmMethodContext *vmc, VmIntrinsicSite *site,
+                                const jvalue *args, jvalue *retVal);
+
+struct VmIntrinsic {
+    const char *clazzDescriptor;
+    const char *name;
+    const char *sign;
+    bool isStatic;
+    VmIntrinsicFunc func;
+};
+
+struct VmIntrinsicSite {
+    const VmIntrinsic *intrinsic;
+
+    // the last receiver, valid in the same VmTempData::refEpoch.
+    jobject receiver;
+    uint32_t refEpoch;
+    bool isExact;
+
+    // the last result of the receiver, valid in the same VmTempData::epoch.
+    bool hasVal;
+    uint32_t epoch;
+    jvalue val;
+};
+
+class VmIntrinsics {
+public:
+    static bool invoke(VmMethodContext *vmc);
+
+private:
+    static const VmIntrinsic intrinsics[];
+
+    // one map per thread, a site keeps the refs of its frames.
+    // key: the invoke instruction, value: nullptr if not an intrinsic.
+    static thread_local std::map<const u2 *, VmIntrinsicSite> sites;
+
+    static const VmIntrinsic *match(VmMethodContext *vmc);
+
+    static void fetchArgs(const VmMethodContext *vmc, jvalue *args);
+};
+
+
+#endif //VM_VMINTRINSICS_H
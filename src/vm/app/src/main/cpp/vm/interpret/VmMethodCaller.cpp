@@ -6,15 +6,26 @@
 #include "../JavaException.h"
 #include "../../VmContext.h"
 #include "../interpret/StandardInterpret.h"
+#include "VmIntrinsics.h"
 
-uint32_t VmJniMethodCaller::cacheKey = 0;
+thread_local VmCacheType *VmJniMethodCaller::cacheType = nullptr;
 
-void VmJniMethodCaller::call(VmMethodContext *vmc) {
+bool VmJniMethodCaller::call(VmMethodContext *vmc) {
     if (!vmc->isMethodToCall()) {
         LOG_E("error vmc's state");
         throw VMException("error vmc's state");
     }
 
+    if (VmIntrinsics::invoke(vmc)) {
+        vmc->run();
+        return true;
+    }
+    vmc->tmp->epoch++;
+    VM_CONTEXT::vm->getArrayCache()->flush();
+    if (VmJniMethodCaller::cacheType == nullptr) {
+        VmJniMethodCaller::cacheType = VM_CONTEXT::vm->newCacheType(sizeof(jvalue));
+    }
+
     const jvalue *params;
     uint32_t paramCount;
     if (vmc->isCallMethodRange()) {
@@ -24,6 +35,8 @@ void VmJniMethodCaller::call(VmMethodContext *vmc) {
     }
     if (vmc->isCallSuperMethod()) {
         VmJniMethodCaller::invokeSuperMethod(vmc, params);
+    } else if (vmc->tmp->pendingInit == vmc->cur_insns()) {
+        VmJniMethodCaller::invokeConstructor(vmc, params);
     } else if (vmc->isCallStaticMethod()) {
         VmJniMethodCaller::invokeStaticMethod(vmc, params);
     } else {
@@ -31,12 +44,13 @@ void VmJniMethodCaller::call(VmMethodContext *vmc) {
     }
     assert(params != nullptr);
     assert(paramCount != 0);
-    VM_CONTEXT::vm->freeCache(VmJniMethodCaller::cacheKey, paramCount);
+    VM_CONTEXT::vm->freeCache(VmJniMethodCaller::cacheType, paramCount);
 
     if ((*VM_CONTEXT::env).ExceptionCheck()) {
         JavaException::throwJavaException(vmc);
     }
     vmc->run();
+    return true;
 }
 
 const jvalue *VmJniMethodCaller::pushMethodParams(
@@ -44,7 +58,7 @@ const jvalue *VmJniMethodCaller::pushMethodParams(
     u2 count = vmc->tmp->src1 >> 4u;
     assert(count <= 5);
     paramCount = MAX(1, count);
-    auto *vars = (jvalue *) VM_CONTEXT::vm->mallocCache(VmJniMethodCaller::cacheKey, paramCount);
+    auto *vars = (jvalue *) VM_CONTEXT::vm->mallocCache(VmJniMethodCaller::cacheType, paramCount);
     u2 varIdx = 0;
     u2 paramIdx = 0;
     if (!vmc->isCallStaticMethod()) {
@@ -92,7 +106,7 @@ const jvalue *VmJniMethodCaller::pushMethodParamsRange(
         VmMethodContext *vmc, uint32_t &paramCount) {
     u2 count = vmc->tmp->src1;
     paramCount = MAX(1, count);
-    auto *vars = (jvalue *) VM_CONTEXT::vm->mallocCache(VmJniMethodCaller::cacheKey, paramCount);
+    auto *vars = (jvalue *) VM_CONTEXT::vm->mallocCache(VmJniMethodCaller::cacheType, paramCount);
     u2 varIdx = 0;
     u2 paramIdx = 0;
     if (!vmc->isCallStaticMethod()) {
@@ -125,7 +139,7 @@ const jvalue *VmJniMethodCaller::pushMethodParamsRange(
 void VmJniMethodCaller::invokeStaticMethod(VmMethodContext *vmc, const jvalue *params) {
     JNIEnv *env = VM_CONTEXT::env;
     jmethodID methodToCall = vmc->method->resolveMethod(vmc->tmp->val_1.u4, true);
-    if ((*env).ExceptionCheck()) {
+    if (methodToCall == nullptr) {
         JavaException::throwJavaException(vmc);
         return;
     }
@@ -200,7 +214,7 @@ void VmJniMethodCaller::invokeStaticMethod(VmMethodContext *vmc, const jvalue *p
 void VmJniMethodCaller::invokeSuperMethod(VmMethodContext *vmc, const jvalue *params) {
     JNIEnv *env = VM_CONTEXT::env;
     jmethodID methodToCall = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
-    if ((*env).ExceptionCheck()) {
+    if (methodToCall == nullptr) {
         JavaException::throwJavaException(vmc);
         return;
     }
@@ -277,10 +291,29 @@ void VmJniMethodCaller::invokeSuperMethod(VmMethodContext *vmc, const jvalue *pa
 #endif
 }
 
+void VmJniMethodCaller::invokeConstructor(VmMethodContext *vmc, const jvalue *params) {
+    JNIEnv *env = VM_CONTEXT::env;
+    vmc->tmp->pendingInit = nullptr;
+    jmethodID methodToCall = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
+    if (methodToCall == nullptr) {
+        JavaException::throwJavaException(vmc);
+        return;
+    }
+
+    vmc->callMethodByJni();
+    vmc->retVal->j = 0L;
+    // new-instance and invoke-direct <init> in one transition.
+    jobject obj = (*env).NewObjectA(vmc->tmp->pendingClass, methodToCall, params);
+    if (obj != nullptr) {
+        vmc->setRegisterAsObject(vmc->tmp->pendingReg, obj);
+    }
+    LOG_D_VM("new object by <init>: %p", obj);
+}
+
 void VmJniMethodCaller::invokeMethod(VmMethodContext *vmc, const jvalue *params) {
     JNIEnv *env = VM_CONTEXT::env;
     jmethodID methodToCall = vmc->method->resolveMethod(vmc->tmp->val_1.u4, false);
-    if ((*env).ExceptionCheck()) {
+    if (methodToCall == nullptr) {
         JavaException::throwJavaException(vmc);
         return;
     }
@@ -454,20 +487,19 @@ VmJniMethodCaller::debugInvokeMethod(VmMethodContext *vmc, jmethodID methodCalle
 
 #endif
 
-VmJniMethodCaller::VmJniMethodCaller() {
-    if (VmJniMethodCaller::cacheKey == 0) {
-        VmJniMethodCaller::cacheKey = VM_CONTEXT::vm->newCacheType(sizeof(jvalue));
-    }
-    assert(VmJniMethodCaller::cacheKey != 0);
-}
-
-
-void VmKeyMethodCaller::call(VmMethodContext *vmc) {
+bool VmKeyMethodCaller::call(VmMethodContext *vmc) {
     jmethodID methodToCall = vmc->method->resolveMethod(
             vmc->tmp->val_1.u4, vmc->isCallStaticMethod());
-    if ((*VM_CONTEXT::env).ExceptionCheck()) {
+    if (methodToCall == nullptr) {
         JavaException::throwJavaException(vmc);
-        return;
+        // a catch handler must not redo the invoke.
+        vmc->run();
+        return false;
+    }
+    if (VM_CONTEXT::vm->isStackFull()) {
+        JavaException::throwStackOverflowError(vmc, VM_CONTEXT::vm->getDepth());
+        vmc->run();
+        return false;
     }
     VM_CONTEXT::vm->pushWithoutParams(methodToCall, vmc->retVal);
     VmMethodContext *curVMC = VM_CONTEXT::vm->getCurVMC();
@@ -483,6 +515,7 @@ void VmKeyMethodCaller::call(VmMethodContext *vmc) {
     VmKeyMethodCaller::printMethodParam(vmc, curVMC);
 #endif
     curVMC->run();
+    return true;
 }
 
 void VmKeyMethodCaller::pushMethodParams(const VmMethodContext *src, VmMethodContext *dst) {
@@ -493,9 +526,7 @@ void VmKeyMethodCaller::pushMethodParams(const VmMethodContext *src, VmMethodCon
     u2 regStart = dst->method->code->registersSize - dst->method->code->insSize;
     u2 regOff = 0;
     if (!src->isCallStaticMethod()) {
-        dst->setRegisterAsObject(
-                regStart + regOff,
-                src->getRegisterAsObject(src->tmp->dst & 0x0fu));
+        dst->moveRegisterObject(regStart + regOff, src, src->tmp->dst & 0x0fu);
         regOff++;
         src->tmp->dst >>= 4u;
     }
@@ -524,9 +555,7 @@ void VmKeyMethodCaller::pushMethodParams(const VmMethodContext *src, VmMethodCon
                          varIdx, shorty[varIdx + 1],
                          src->getRegisterAsObject(src->tmp->dst & 0x0fu),
                          src->tmp->dst & 0x0fu);
-                dst->setRegisterAsObject(
-                        regStart + regOff,
-                        src->getRegisterAsObject(src->tmp->dst & 0x0fu));
+                dst->moveRegisterObject(regStart + regOff, src, src->tmp->dst & 0x0fu);
                 LOG_D_VM("param[%d]-type: %c, value: %p",
                          varIdx, shorty[varIdx + 1], dst->getRegisterAsObject(regStart + regOff));
                 break;
@@ -545,25 +574,23 @@ void VmKeyMethodCaller::pushMethodParams(const VmMethodContext *src, VmMethodCon
         }
     }
     if (regOff == 4 && count == 5) {
-        LOG_D_VM("param[%d]-type: %c, in-value: 0x%016lx, in-reg: %u",
+        LOG_D_VM("param[%d]-type: %c, in-value: 0x%08x, in-reg: %u",
                  varIdx, shorty[varIdx + 1],
-                 src->getRegisterWide(src->tmp->src1 & 0x0fu),
+                 src->getRegister(src->tmp->src1 & 0x0fu),
                  src->tmp->src1 & 0x0fu);
         switch (shorty[varIdx + 1]) {
             case 'L':
-                dst->setRegisterAsObject(
-                        regStart + regOff,
-                        src->getRegisterAsObject(src->tmp->src1 & 0x0fu));
+                dst->moveRegisterObject(regStart + regOff, src, src->tmp->src1 & 0x0fu);
                 break;
 
             default:
                 dst->setRegister(
                         regStart + regOff,
-                        src->getRegister(src->tmp->src2 & 0x0fu));
+                        src->getRegister(src->tmp->src1 & 0x0fu));
                 break;
         }
-        LOG_D_VM("param[%d]-type: %c, value: 0x%016lx",
-                 varIdx, shorty[varIdx + 1], dst->getRegisterWide(regStart + regOff));
+        LOG_D_VM("param[%d]-type: %c, value: 0x%08x",
+                 varIdx, shorty[varIdx + 1], dst->getRegister(regStart + regOff));
     }
     LOG_D_VM("pushMethodParams, finish.");
 }
@@ -573,10 +600,12 @@ void VmKeyMethodCaller::pushMethodParamsRange(const VmMethodContext *src, VmMeth
     u2 count = src->tmp->src1;
     assert(count == dst->method->code->insSize);
     u2 regStart = dst->method->code->registersSize - dst->method->code->insSize;
+    // the object registers keep their indexes into tmp->refs, so one copy is enough.
+    memcpy(dst->reg + regStart, src->reg + src->tmp->dst, count * sizeof(u4));
     for (u2 regOff = 0; regOff < count; regOff++) {
-        dst->setRegisterWide(
-                regStart + regOff,
-                src->getRegisterWide(src->tmp->dst + regOff));
+        if (src->isRegisterObject(src->tmp->dst + regOff)) {
+            dst->markRegisterObject(regStart + regOff);
+        }
     }
     LOG_D_VM("pushMethodParamsRange, finish.");
 }
@@ -596,41 +625,41 @@ void VmKeyMethodCaller::printMethodParam(const VmMethodContext *src, const VmMet
     for (u2 varIdx = 0; shorty[varIdx + 1] != '\0'; regStart++, varIdx++) {
         switch (*shorty) {
             case 'I':
-                LOG_D_VM("var(%d) value (int): %d", varIdx, dst->reg[regStart].i);
+                LOG_D_VM("var(%d) value (int): %d", varIdx, dst->getRegisterInt(regStart));
                 break;
 
             case 'Z':
-                dst->reg[regStart].z ? LOG_D_VM("var(%d) value (bool): true", varIdx)
+                dst->getRegister(regStart) != 0 ? LOG_D_VM("var(%d) value (bool): true", varIdx)
                                      : LOG_D_VM("var(%d) value (bool): false", varIdx);
                 break;
 
             case 'B':
-                LOG_D_VM("var(%d) value (byte): 0x%02x", varIdx, dst->reg[regStart].b);
+                LOG_D_VM("var(%d) value (byte): 0x%02x", varIdx, (u1) dst->getRegister(regStart));
                 break;
 
             case 'S':
-                LOG_D_VM("var(%d) value (short): %d", varIdx, dst->reg[regStart].s);
+                LOG_D_VM("var(%d) value (short): %d", varIdx, (jshort) dst->getRegister(regStart));
                 break;
 
             case 'C':
-                LOG_D_VM("var(%d) value (char): %c", varIdx, dst->reg[regStart].c);
+                LOG_D_VM("var(%d) value (char): %c", varIdx, (jchar) dst->getRegister(regStart));
                 break;
 
             case 'F':
-                LOG_D_VM("var(%d) value (float): %f", varIdx, dst->reg[regStart].f);
+                LOG_D_VM("var(%d) value (float): %f", varIdx, dst->getRegisterFloat(regStart));
                 break;
 
             case 'L':
-                LOG_D_VM("var(%d) value (object): %p", varIdx, dst->reg[regStart].l);
+                LOG_D_VM("var(%d) value (object): %p", varIdx, dst->getRegisterAsObject(regStart));
                 break;
 
             case 'J':
-                LOG_D_VM("var(%d) value (long): %ld", varIdx, dst->reg[regStart].j);
+                LOG_D_VM("var(%d) value (long): %ld", varIdx, dst->getRegisterLong(regStart));
                 regStart++;
                 break;
 
             case 'D':
-                LOG_D_VM("var(%d) value (double): %lf", varIdx, dst->reg[regStart].d);
+                LOG_D_VM("var(%d) value (double): %lf", varIdx, dst->getRegisterDouble(regStart));
                 regStart++;
                 break;
 
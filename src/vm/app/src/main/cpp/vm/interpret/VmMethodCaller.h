@@ -10,14 +10,18 @@
 
 class VmMethodCaller {
 public:
-    virtual void call(VmMethodContext *vmc) = 0;
+    /**
+     * @return false if the method wasn't called, the exception is pending in
+     * vmc, which must not run its invoke again.
+     */
+    virtual bool call(VmMethodContext *vmc) = 0;
 
     virtual ~VmMethodCaller() {};
 };
 
 class VmKeyMethodCaller : public VmMethodCaller {
 public:
-    void call(VmMethodContext *vmc) override;
+    bool call(VmMethodContext *vmc) override;
 
 private:
     static void pushMethodParams(const VmMethodContext *src, VmMethodContext *dst);
@@ -31,12 +35,11 @@ private:
 
 class VmJniMethodCaller : public VmMethodCaller {
 public:
-    void call(VmMethodContext *vmc) override;
-
-    VmJniMethodCaller();
+    bool call(VmMethodContext *vmc) override;
 
 private:
-    static uint32_t cacheKey;
+    // a cache type belongs to the vm cache of one thread.
+    static thread_local VmCacheType *cacheType;
 
     static const jvalue *pushMethodParams(VmMethodContext *vmc, uint32_t &paramCount);
 
@@ -48,6 +51,8 @@ private:
 
     static void invokeStaticMethod(VmMethodContext *vmc, const jvalue *params);
 
+    static void invokeConstructor(VmMethodContext *vmc, const jvalue *params);
+
 #if defined(VM_DEBUG_FULL)
     static void debugInvokeMethod(VmMethodContext *vmc, jmethodID methodCalled,
                                       const char *shorty, const jvalue retVal,
@@ -3,7 +3,10 @@
 #include "vm/interpret/StandardInterpret.h"
 
 #include <jni.h>
+#include <algorithm>
 #include <cassert>
+#include <string>
+#include <vector>
 
 /**
  * get JNIEnv, the version usually is 1.4.
@@ -22,6 +25,7 @@ jint JNI_OnLoad(JavaVM *vm, void *unused) {
     }
     assert(env != nullptr);
     VM_CONTEXT::env = env;
+    VM_CONTEXT::javaVm = vm;
 
     Util::buildFileSystem();
 
@@ -38,4 +42,309 @@ jint JNI_OnLoad(JavaVM *vm, void *unused) {
     VM_CONTEXT::changeTopApplication();
     LOG_I("VM init success.");
     return JNI_VERSION_1_4;
-}
\ No newline at end of file
+}
+/**
+ * a snapshot of the vm memory as one long[], the layout is documented by
+ * ShellApplication.getVmStats.
+ */
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_dalunlun_vm_ShellApplication_getVmStats(JNIEnv *env, jclass) {
+    if (VM_CONTEXT::vm == nullptr) {
+        return nullptr;
+    }
+    VM_CONTEXT::attachCurrentThread();
+    const VmStats stats = VM_CONTEXT::vm->getStats();
+    std::vector<jlong> values = {
+            stats.memory.committedPages,
+            stats.memory.usedPages,
+            stats.memory.cachedPages,
+            stats.memory.residentPages,
+            (jlong) stats.memory.reclaimedPages,
+            (jlong) stats.memory.bitmapMallocs,
+            (jlong) stats.memory.probes,
+            (jlong) stats.memory.initMinorFaults,
+            (jlong) stats.memory.initMajorFaults,
+            (jlong) stats.memory.minorFaults,
+            (jlong) stats.memory.majorFaults,
+            stats.stack.frames,
+            stats.stack.maxFrames,
+            stats.stack.pages,
+            stats.stack.fullPages,
+            stats.stack.emptyPages,
+            (jlong) stats.cache.size(),
+    };
+    for (const auto &it : stats.cache) {
+        values.push_back(it.size);
+        values.push_back((jlong) it.bytes);
+        values.push_back((jlong) it.maxBytes);
+        values.push_back(it.pages);
+    }
+    jlongArray ret = (*env).NewLongArray(values.size());
+    if (ret != nullptr) {
+        (*env).SetLongArrayRegion(ret, 0, values.size(), values.data());
+    }
+    return ret;
+}
+
+/**
+ * forwarded from onTrimMemory, level is a VmTrimLevel, see ShellApplication.
+ */
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_dalunlun_vm_ShellApplication_trimVmMemory(JNIEnv *, jclass, jint level) {
+    if (VM_CONTEXT::vm == nullptr ||
+        level < (jint) VmTrimLevel::Light || level > (jint) VmTrimLevel::Critical) {
+        return;
+    }
+    VM_CONTEXT::attachCurrentThread();
+    VM_CONTEXT::vm->trimMemory((VmTrimLevel) level);
+}
+
+struct BatchUnboxMethods {
+    jclass cBoolean, cCharacter, cNumber;
+    jmethodID booleanValue, charValue, intValue, longValue, floatValue, doubleValue;
+};
+
+static const BatchUnboxMethods &getBatchUnboxMethods(JNIEnv *env) {
+    // boot classes, never unloaded.
+    static const BatchUnboxMethods methods = [env]() {
+        BatchUnboxMethods ret{};
+        jclass clazz = (*env).FindClass(VM_REFLECT::C_NAME_Boolean);
+        ret.cBoolean = (jclass) (*env).NewGlobalRef(clazz);
+        (*env).DeleteLocalRef(clazz);
+        clazz = (*env).FindClass(VM_REFLECT::C_NAME_Character);
+        ret.cCharacter = (jclass) (*env).NewGlobalRef(clazz);
+        (*env).DeleteLocalRef(clazz);
+        clazz = (*env).FindClass(VM_REFLECT::C_NAME_Number);
+        ret.cNumber = (jclass) (*env).NewGlobalRef(clazz);
+        (*env).DeleteLocalRef(clazz);
+        ret.booleanValue = (*env).GetMethodID(ret.cBoolean,
+                                              VM_REFLECT::NAME_Boolean_booleanValue,
+                                              VM_REFLECT::SIGN_Boolean_booleanValue);
+        ret.charValue = (*env).GetMethodID(ret.cCharacter,
+                                           VM_REFLECT::NAME_Character_charValue,
+                                           VM_REFLECT::SIGN_Character_charValue);
+        ret.intValue = (*env).GetMethodID(ret.cNumber,
+                                          VM_REFLECT::NAME_Number_intValue,
+                                          VM_REFLECT::SIGN_Number_intValue);
+        ret.longValue = (*env).GetMethodID(ret.cNumber,
+                                           VM_REFLECT::NAME_Number_longValue,
+                                           VM_REFLECT::SIGN_Number_longValue);
+        ret.floatValue = (*env).GetMethodID(ret.cNumber,
+                                            VM_REFLECT::NAME_Number_floatValue,
+                                            VM_REFLECT::SIGN_Number_floatValue);
+        ret.doubleValue = (*env).GetMethodID(ret.cNumber,
+                                             VM_REFLECT::NAME_Number_doubleValue,
+                                             VM_REFLECT::SIGN_Number_doubleValue);
+        return ret;
+    }();
+    return methods;
+}
+
+static void throwBatchError(JNIEnv *env, const char *className, const char *msg) {
+    (*env).ThrowNew((*env).FindClass(className), msg);
+}
+
+/**
+ * one argument of a batch tuple, boxed if the parameter is a primitive.
+ * @return false with an exception pending if it doesn't fit the parameter.
+ */
+static bool unboxBatchArg(JNIEnv *env, char type, jobject arg, jvalue &val) {
+    if (type == 'L') {
+        val.l = arg;
+        return true;
+    }
+    if (arg == nullptr) {
+        throwBatchError(env, VM_REFLECT::C_NAME_NullPointerException, "null primitive argument");
+        return false;
+    }
+    const BatchUnboxMethods &methods = getBatchUnboxMethods(env);
+    jclass expected = type == 'Z' ? methods.cBoolean
+                                  : type == 'C' ? methods.cCharacter : methods.cNumber;
+    if (!(*env).IsInstanceOf(arg, expected)) {
+        throwBatchError(env, VM_REFLECT::C_NAME_IllegalArgumentException,
+                        "argument type mismatch");
+        return false;
+    }
+    switch (type) {
+        case 'Z':
+            val.z = (*env).CallBooleanMethod(arg, methods.booleanValue);
+            break;
+        case 'C':
+            val.c = (*env).CallCharMethod(arg, methods.charValue);
+            break;
+        case 'B':
+            val.b = (jbyte) (*env).CallIntMethod(arg, methods.intValue);
+            break;
+        case 'S':
+            val.s = (jshort) (*env).CallIntMethod(arg, methods.intValue);
+            break;
+        case 'J':
+            val.j = (*env).CallLongMethod(arg, methods.longValue);
+            break;
+        case 'F':
+            val.f = (*env).CallFloatMethod(arg, methods.floatValue);
+            break;
+        case 'D':
+            val.d = (*env).CallDoubleMethod(arg, methods.doubleValue);
+            break;
+        default:
+            val.i = (*env).CallIntMethod(arg, methods.intValue);
+            break;
+    }
+    return true;
+}
+
+// an array of the return type, nullptr for void.
+static jarray newBatchResults(JNIEnv *env, char type, jsize count) {
+    switch (type) {
+        case 'V':
+            return nullptr;
+        case 'Z':
+            return (*env).NewBooleanArray(count);
+        case 'C':
+            return (*env).NewCharArray(count);
+        case 'B':
+            return (*env).NewByteArray(count);
+        case 'S':
+            return (*env).NewShortArray(count);
+        case 'I':
+            return (*env).NewIntArray(count);
+        case 'J':
+            return (*env).NewLongArray(count);
+        case 'F':
+            return (*env).NewFloatArray(count);
+        case 'D':
+            return (*env).NewDoubleArray(count);
+        default: {
+            jclass cObject = (*env).FindClass(VM_REFLECT::C_NAME_Object);
+            jarray ret = (*env).NewObjectArray(count, cObject, nullptr);
+            (*env).DeleteLocalRef(cObject);
+            return ret;
+        }
+    }
+}
+
+template<typename T>
+static std::vector<T> toBatchValues(const jvalue *results, jsize count, T jvalue::*field) {
+    std::vector<T> ret(count);
+    for (jsize i = 0; i < count; i++) {
+        ret[i] = results[i].*field;
+    }
+    return ret;
+}
+
+static void copyBatchResults(JNIEnv *env, char type, jarray ret, jsize off,
+                             const jvalue *results, jsize count) {
+    switch (type) {
+        case 'Z':
+            (*env).SetBooleanArrayRegion((jbooleanArray) ret, off, count,
+                                         toBatchValues(results, count, &jvalue::z).data());
+            break;
+        case 'C':
+            (*env).SetCharArrayRegion((jcharArray) ret, off, count,
+                                      toBatchValues(results, count, &jvalue::c).data());
+            break;
+        case 'B':
+            (*env).SetByteArrayRegion((jbyteArray) ret, off, count,
+                                      toBatchValues(results, count, &jvalue::b).data());
+            break;
+        case 'S':
+            (*env).SetShortArrayRegion((jshortArray) ret, off, count,
+                                       toBatchValues(results, count, &jvalue::s).data());
+            break;
+        case 'I':
+            (*env).SetIntArrayRegion((jintArray) ret, off, count,
+                                     toBatchValues(results, count, &jvalue::i).data());
+            break;
+        case 'J':
+            (*env).SetLongArrayRegion((jlongArray) ret, off, count,
+                                      toBatchValues(results, count, &jvalue::j).data());
+            break;
+        case 'F':
+            (*env).SetFloatArrayRegion((jfloatArray) ret, off, count,
+                                       toBatchValues(results, count, &jvalue::f).data());
+            break;
+        case 'D':
+            (*env).SetDoubleArrayRegion((jdoubleArray) ret, off, count,
+                                        toBatchValues(results, count, &jvalue::d).data());
+            break;
+        default:
+            for (jsize i = 0; i < count; i++) {
+                (*env).SetObjectArrayElement((jobjectArray) ret, off + i, results[i].l);
+            }
+            break;
+    }
+}
+
+/**
+ * calls a key function count times through Vm::callMethodBatch, see
+ * ShellApplication.callMethodBatch. The arguments are unboxed and run by
+ * chunks of VM_BATCH_CHUNK_SIZE calls, each chunk in its own local frame.
+ */
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_com_dalunlun_vm_ShellApplication_callMethodBatch(
+        JNIEnv *env, jclass, jobject method, jobject instance, jobjectArray args,
+        jint count) {
+    if (VM_CONTEXT::vm == nullptr || method == nullptr || count < 0) {
+        throwBatchError(env, VM_REFLECT::C_NAME_IllegalArgumentException, "bad batch call");
+        return nullptr;
+    }
+    VM_CONTEXT::attachCurrentThread();
+    jmethodID methodId = (*env).FromReflectedMethod(method);
+    VmMethod vmMethod{};
+    // the code is only there for a key function.
+    vmMethod.reset(methodId, false);
+    if (!Vm::isKeyFunction(vmMethod.method_id)) {
+        throwBatchError(env, VM_REFLECT::C_NAME_IllegalArgumentException, "not a key function");
+        return nullptr;
+    }
+    if (!DexFile::isStaticMethod(vmMethod.accessFlags) && instance == nullptr) {
+        throwBatchError(env, VM_REFLECT::C_NAME_NullPointerException, "null instance");
+        return nullptr;
+    }
+    const std::string shorty = vmMethod.getShorty();
+    const auto paramCount = (jsize) shorty.size() - 1;
+    const jsize argCount = args == nullptr ? 0 : (*env).GetArrayLength(args);
+    if ((jlong) count * paramCount != argCount) {
+        throwBatchError(env, VM_REFLECT::C_NAME_IllegalArgumentException,
+                        "args.length != count * parameters");
+        return nullptr;
+    }
+    jarray ret = newBatchResults(env, shorty[0], count);
+    if (shorty[0] != 'V' && ret == nullptr) {
+        return nullptr;
+    }
+
+    const auto chunkSize = (jsize) VM_CONFIG::VM_BATCH_CHUNK_SIZE;
+    std::vector<jvalue> params;
+    std::vector<jvalue> results;
+    for (jsize begin = 0; begin < count; begin += chunkSize) {
+        const jsize n = std::min(count - begin, chunkSize);
+        // the arguments and the object results of the chunk.
+        if ((*env).PushLocalFrame(n * (paramCount + 1) + 1) < 0) {
+            return nullptr;
+        }
+        params.resize(n * paramCount);
+        results.assign(n, jvalue{});
+        bool isUnboxed = true;
+        for (jsize i = 0; isUnboxed && i < n * paramCount; i++) {
+            jobject arg = (*env).GetObjectArrayElement(args, begin * paramCount + i);
+            isUnboxed = unboxBatchArg(env, shorty[1 + i % paramCount], arg, params[i]);
+        }
+        const uint32_t done = !isUnboxed ? 0 : Vm::callMethodBatch(
+                instance, methodId, params.data(), n, results.data());
+        if (done != (uint32_t) n) {
+            // thrown by an argument or by the key function.
+            (*env).PopLocalFrame(nullptr);
+            return nullptr;
+        }
+        if (ret != nullptr) {
+            copyBatchResults(env, shorty[0], ret, begin, results.data(), n);
+        }
+        (*env).PopLocalFrame(nullptr);
+    }
+    return ret;
+}
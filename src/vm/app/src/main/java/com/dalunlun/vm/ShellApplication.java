@@ -1,10 +1,100 @@
 package com.dalunlun.vm;
 
 import android.app.Application;
+import android.content.ComponentCallbacks2;
+import android.content.Context;
+import android.content.res.Configuration;
+
+import java.lang.reflect.Method;
 
 public class ShellApplication extends Application {
+    // layout of getVmStats(). VmRandomMemory, in pages:
+    public static final int STATS_MEMORY_COMMITTED_PAGES = 0;
+    public static final int STATS_MEMORY_USED_PAGES = 1;
+    public static final int STATS_MEMORY_CACHED_PAGES = 2;
+    public static final int STATS_MEMORY_RESIDENT_PAGES = 3;
+    public static final int STATS_MEMORY_RECLAIMED_PAGES = 4;
+    // mallocs that searched the page bitmap, and the bitmap words they probed.
+    public static final int STATS_MEMORY_BITMAP_MALLOCS = 5;
+    public static final int STATS_MEMORY_PROBES = 6;
+    // page faults of the process while the arena was built, and since then.
+    public static final int STATS_MEMORY_INIT_MINOR_FAULTS = 7;
+    public static final int STATS_MEMORY_INIT_MAJOR_FAULTS = 8;
+    public static final int STATS_MEMORY_MINOR_FAULTS = 9;
+    public static final int STATS_MEMORY_MAJOR_FAULTS = 10;
+    // the vm stack of the calling thread, every thread has its own. 0 if it never ran the vm.
+    public static final int STATS_STACK_FRAMES = 11;
+    public static final int STATS_STACK_MAX_FRAMES = 12;
+    public static final int STATS_STACK_PAGES = 13;
+    public static final int STATS_STACK_FULL_PAGES = 14;
+    public static final int STATS_STACK_EMPTY_PAGES = 15;
+    // the vm cache of the calling thread: the number of cache types, followed by
+    // STATS_CACHE_TYPE_FIELDS values for each of them.
+    public static final int STATS_CACHE_TYPES = 16;
+    public static final int STATS_CACHE_TYPE_SIZE = 0;
+    public static final int STATS_CACHE_TYPE_BYTES = 1;
+    public static final int STATS_CACHE_TYPE_MAX_BYTES = 2;
+    public static final int STATS_CACHE_TYPE_PAGES = 3;
+    public static final int STATS_CACHE_TYPE_FIELDS = 4;
+
+    // levels of trimVmMemory(), the VmTrimLevel of the vm.
+    public static final int VM_TRIM_LIGHT = 0;
+    public static final int VM_TRIM_MODERATE = 1;
+    public static final int VM_TRIM_CRITICAL = 2;
+
     @Override
     public void onCreate() {
         System.loadLibrary("vm");
+        // the vm made the real application the top one, so this one gets no callbacks any more.
+        Context app = getApplicationContext();
+        if (app != null && app != this) {
+            app.registerComponentCallbacks(new ComponentCallbacks2() {
+                @Override
+                public void onTrimMemory(int level) {
+                    trimVmMemory(toVmTrimLevel(level));
+                }
+
+                @Override
+                public void onConfigurationChanged(Configuration newConfig) {
+                }
+
+                @Override
+                public void onLowMemory() {
+                    trimVmMemory(VM_TRIM_CRITICAL);
+                }
+            });
+        }
     }
+
+    @Override
+    public void onTrimMemory(int level) {
+        super.onTrimMemory(level);
+        trimVmMemory(toVmTrimLevel(level));
+    }
+
+    static int toVmTrimLevel(int level) {
+        if (level >= TRIM_MEMORY_COMPLETE || level == TRIM_MEMORY_RUNNING_CRITICAL) {
+            return VM_TRIM_CRITICAL;
+        }
+        if (level >= TRIM_MEMORY_BACKGROUND || level == TRIM_MEMORY_RUNNING_LOW) {
+            return VM_TRIM_MODERATE;
+        }
+        return VM_TRIM_LIGHT;
+    }
+
+    // a snapshot of the vm memory, null before the vm is loaded.
+    public static native long[] getVmStats();
+
+    // gives vm memory back to the system, level is one of VM_TRIM_*.
+    public static native void trimVmMemory(int level);
+
+    /**
+     * calls the key function method count times, the vm sets the call up once
+     * for all of them. args holds count tuples of its parameters, primitives
+     * boxed; instance is ignored by a static method. The results come back as
+     * an array of the return type: int[] for int, Object[] for objects, null
+     * for void. The first exception thrown ends the batch.
+     */
+    public static native Object callMethodBatch(Method method, Object instance, Object[] args,
+                                                int count);
 }